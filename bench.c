@@ -0,0 +1,766 @@
+// Copyright Similea Alin-Andrei 314CA 2022-2023
+// The benchmarks of image_editor ("make bench"). They time the commands and
+// compare the way some of them used to work with the way they work now, so
+// that old code is kept here, out of the program. The editor has no header:
+// its source is included whole, without its main.
+#define BENCH
+#include "image_editor.c"
+
+// ===========================
+// THE OLD CODE
+// ===========================
+
+image_struct *full_rotation_90_back(image_struct *image)
+{
+	image_struct *result;
+	if (image_alloc(&result) == 0)
+		return NULL;
+
+	strcpy(result->image_type, image->image_type);
+	result->height = image->width;	// We swap the height with the width.
+	result->width = image->height;
+	result->max_value = image->max_value;
+
+	if (pixel_alloc(result) == 0)
+		return NULL;
+	if (select_alloc(&result->select) == 0)
+		return NULL;
+	result->select->x1 = image->select->x1;
+	result->select->y1 = image->select->y1;
+	result->select->x2 = image->select->y2;
+	result->select->y2 = image->select->x2;
+
+	int psize = pixel_size(image);
+
+	// We go through the resulting matrix from the first column upward (which
+	// corresponds to the first line in the initial matrix from left to right)
+	// towards the last column of the matrix(which corresponds to the last line
+	// in the initial matrix).
+	int i_initial = 0;
+	for (int j = 0; j < result->width; j++) {
+		int j_initial = 0;
+		for (int i = result->height - 1; i >= 0; i--) {
+			copy_pixel(pixel_ptr(result, i, j),
+					pixel_ptr(image, i_initial, j_initial), psize);
+			j_initial++;
+		}
+		i_initial++;
+	}
+
+	free_img(image);
+
+	return result;
+}
+
+image_struct *full_rotation_90(image_struct *image)
+{
+	image_struct *result;
+	if (image_alloc(&result) == 0)
+		return NULL;
+
+	strcpy(result->image_type, image->image_type);
+	result->height = image->width;	// We swap the height with the width.
+	result->width = image->height;
+	result->max_value = image->max_value;
+
+	if (pixel_alloc(result) == 0)
+		return NULL;
+	if (select_alloc(&result->select) == 0)
+		return NULL;
+	result->select->x1 = image->select->x1;
+	result->select->y1 = image->select->y1;
+	result->select->x2 = image->select->y2;
+	result->select->y2 = image->select->x2;
+
+	int psize = pixel_size(image);
+
+	// We go through the resulting matrix from the last column downward (which
+	// corresponds to the first line in the initial matrix from left to right)
+	// towards the first column of the matrix(which corresponds to the last line
+	// in the initial matrix).
+	int i_initial = 0;
+	for (int j = result->width - 1; j >= 0; j--) {
+		int j_initial = 0;
+		for (int i = 0; i < result->height; i++) {
+			copy_pixel(pixel_ptr(result, i, j),
+					pixel_ptr(image, i_initial, j_initial), psize);
+			j_initial++;
+		}
+		i_initial++;
+	}
+
+	free_img(image);
+
+	return result;
+}
+
+image_struct *rotate_old(image_struct *image, int rotation_nr)
+{
+	// The way ROTATE used to work: one 90 degrees rotation at a time, each
+	// one followed by a copy of the whole image.
+	int times = rotation_nr / 90;
+	for (int k = 0; k < (times < 0 ? -times : times); k++) {
+		image_struct *result = times < 0 ? full_rotation_90_back(image)
+										 : full_rotation_90(image);
+		image = copy_image(result);
+		free_img(result);
+	}
+	return image;
+}
+
+void histogram_bins_double(image_struct *image, int bins_nr, long long *bins)
+{
+	// The way HISTOGRAM used to count: a division and a floor() per pixel.
+	double interval = (double)(image->max_value + 1) / bins_nr;
+	for (int i = 0; i < bins_nr; i++)
+		bins[i] = 0;
+	for (int i = 0; i < image->height; i++)
+		for (int j = 0; j < image->width; j++)
+			bins[(int)floor((double)get_sample(image, i, j, 0) / interval)]++;
+}
+
+void equalize_quadratic(image_struct *image)
+{
+	// The way EQUALIZE used to work: the partial sums are computed again for
+	// every value and the pixels are read and written one sample at a time.
+	int area = image->height * image->width;
+	int *freq = (int *)calloc(image->max_value + 1, sizeof(int));
+	int *new_values = (int *)malloc((image->max_value + 1) * sizeof(int));
+	for (int i = 0; i < image->height; i++)
+		for (int j = 0; j < image->width; j++)
+			freq[get_sample(image, i, j, 0)]++;
+	for (int i = 0; i <= image->max_value; i++) {
+		int partial_sum_freq = 0;
+		for (int j = 0; j <= i; j++)
+			partial_sum_freq += freq[j];
+		double new_val =
+			(double)image->max_value * (double)partial_sum_freq / (double)area;
+		new_values[i] = round(clamp(new_val, 0, image->max_value));
+	}
+	for (int i = 0; i < image->height; i++)
+		for (int j = 0; j < image->width; j++)
+			set_sample(image, i, j, 0, new_values[get_sample(image, i, j, 0)]);
+	free(freq);
+	free(new_values);
+}
+
+// ===========================
+// HARNESS
+// ===========================
+
+#define BENCH_WARMUP 1	// runs before the timed ones, not counted
+#define NMAX_BENCH_RUNS 64
+#define NMAX_BENCH_SIZES 16
+
+struct bench_struct {
+	int runs;	  // timed runs of everything
+	char *dir;	  // where the images are written and read
+	FILE *json;	  // the results, or NULL
+	int nr_results;
+};
+
+typedef struct bench_struct bench_struct;
+
+bench_struct bench;
+
+int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+image_struct *bench_image(char *image_type, int width, int height,
+						  int max_value)
+{
+	// A synthetic image with random pixels and the whole image selected.
+	image_struct *image;
+	if (image_alloc(&image) == 0)
+		return NULL;
+	strcpy(image->image_type, image_type);
+	image->width = width;
+	image->height = height;
+	image->max_value = max_value;
+	if (pixel_alloc(image) == 0 || select_alloc(&image->select) == 0)
+		return NULL;
+
+	srand(1);
+	for (int i = 0; i < height; i++)
+		for (int j = 0; j < width; j++)
+			for (int c = 0; c < image->channels; c++)
+				set_sample(image, i, j, c, rand() % (max_value + 1));
+
+	image->select->x1 = 0;
+	image->select->x2 = width;
+	image->select->y1 = 0;
+	image->select->y2 = height;
+	return image;
+}
+
+int quiet_begin(void)
+{
+	// What the commands print would hide the table, so it goes to
+	// /dev/null while they are timed. Returns the real stdout.
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	int null = open("/dev/null", O_WRONLY);
+	if (null >= 0) {
+		dup2(null, STDOUT_FILENO);
+		close(null);
+	}
+	return saved;
+}
+
+void quiet_end(int saved)
+{
+	fflush(stdout);
+	if (saved >= 0) {
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+	}
+}
+
+void bench_report(char *format, image_struct *image, char *name,
+				  double *times, char *check)
+{
+	// Everything that is timed ends here: times holds the BENCH_WARMUP runs
+	// and then the timed ones. We print the median, the 95th percentile
+	// (nearest rank) and the megapixels per second as a line of the table
+	// and, with --json, as JSON. "check" tells whether the pixels are the
+	// same as the ones of the line above, or is NULL.
+	int runs = bench.runs;
+	double *timed = times + BENCH_WARMUP;
+	qsort(timed, runs, sizeof(double), compare_doubles);
+	double median = timed[runs / 2];
+	double p95 = timed[(int)ceil(0.95 * runs) - 1];
+	int width = image->width, height = image->height;
+	double megapixels = (double)width * height / 1e6;
+	double speed = median > 0 ? megapixels / median : 0;
+	printf("%-6s%8.2f  %-24s%12.3f%12.3f%12.1f", format, megapixels, name,
+		   median * 1000, p95 * 1000, speed);
+	if (check)
+		printf("  %s", check);
+	printf("\n");
+	if (bench.json) {
+		fprintf(bench.json,
+				"%s    {\"format\": \"%s\", \"megapixels\": %.2f, "
+				"\"width\": %d, \"height\": %d, \"command\": \"%s\", "
+				"\"median_ms\": %.3f, \"p95_ms\": %.3f, \"mp_per_s\": %.1f",
+				bench.nr_results ? ",\n" : "", format, megapixels, width,
+				height, name, median * 1000, p95 * 1000, speed);
+		if (check)
+			fprintf(bench.json, ", \"check\": \"%s\"", check);
+		fprintf(bench.json, "}");
+	}
+	bench.nr_results++;
+}
+
+char *same_pixels(image_struct *a, image_struct *b)
+{
+	if (a->width != b->width || a->height != b->height)
+		return "DIFFERENT";
+	for (int i = 0; i < a->height; i++)
+		if (memcmp(row_ptr(a, i), row_ptr(b, i),
+				   (size_t)a->width * pixel_size(a)) != 0)
+			return "DIFFERENT";
+	return "exact";
+}
+
+// ===========================
+// COMMANDS
+// ===========================
+
+void bench_case(image_struct *base, int loaded, char *format, char *name,
+				char *setup, char *command)
+{
+	// Times "command" on a fresh copy of base (or without an image if not
+	// "loaded"), after "setup", which is not timed. The lines are compiled
+	// once, like a script. The waiting APPLY commands are done in the timed
+	// part, since that is where their pixels are computed.
+	program_struct setup_program, program;
+	init_program(&setup_program);
+	init_program(&program);
+	char line[256];
+	if (setup) {
+		strcpy(line, setup);
+		compile_line(&setup_program, line);
+	}
+	strcpy(line, command);
+	compile_line(&program, line);
+
+	double times[BENCH_WARMUP + NMAX_BENCH_RUNS];
+	for (int run = 0; run < BENCH_WARMUP + bench.runs; run++) {
+		editor_struct editor = {NULL, 0, 0, NULL, NULL, 0, 0, 0};
+		if (loaded) {
+			editor.image = copy_image(base);
+			editor.loaded_img_now = 1;
+		}
+		int saved = quiet_begin();
+		run_program(&editor, &setup_program);
+		double start = clock_seconds(CLOCK_MONOTONIC);
+		run_program(&editor, &program);
+		if (editor.loaded_img_now)
+			run_pending(editor.image, "bench");
+		times[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+		quiet_end(saved);
+		drop_pending("bench");
+		if (editor.loaded_img_now)
+			free_img(editor.image);
+	}
+	free_program(&setup_program);
+	free_program(&program);
+	bench_report(format, base, name, times, NULL);
+}
+
+void bench_commands(image_struct *image, char *format)
+{
+	// All the commands that make sense for the image.
+	int gray = image->channels == 1;
+	int ascii = strcmp(image->image_type, "P2") == 0 ||
+				strcmp(image->image_type, "P3") == 0;
+	int width = image->width, height = image->height;
+
+	char input[PATH_MAX], output[PATH_MAX], command[256 + PATH_MAX];
+	snprintf(input, PATH_MAX, "%s/input.%s", bench.dir, gray ? "pgm" : "ppm");
+	snprintf(output, PATH_MAX, "%s/output.%s", bench.dir,
+			 gray ? "pgm" : "ppm");
+	int saved = quiet_begin();
+	if (ascii)
+		save_text(image, input);
+	else
+		save_binary(image, input);
+	quiet_end(saved);
+
+	snprintf(command, sizeof(command), "LOAD %s", input);
+	bench_case(image, 0, format, "LOAD", NULL, command);
+	snprintf(command, sizeof(command), "SAVE %s", output);
+	bench_case(image, 1, format, "SAVE", NULL, command);
+	snprintf(command, sizeof(command), "SAVE %s ascii", output);
+	bench_case(image, 1, format, "SAVE ascii", NULL, command);
+	if (!ascii && image->max_value <= 255) {
+		char qoi[PATH_MAX];
+		snprintf(qoi, PATH_MAX, "%s/input.qoi", bench.dir);
+		saved = quiet_begin();
+		save_qoi(image, qoi);
+		quiet_end(saved);
+		snprintf(command, sizeof(command), "LOAD %s", qoi);
+		bench_case(image, 0, format, "LOAD qoi", NULL, command);
+		snprintf(command, sizeof(command), "SAVE %s qoi", qoi);
+		bench_case(image, 1, format, "SAVE qoi", NULL, command);
+		unlink(qoi);
+	}
+
+	if (gray) {
+		bench_case(image, 1, format, "EQUALIZE", NULL, "EQUALIZE");
+		bench_case(image, 1, format, "HISTOGRAM", NULL, "HISTOGRAM 50 256");
+	} else {
+		char *kernels[] = {"EDGE", "SHARPEN", "BLUR", "GAUSSIAN_BLUR",
+						   "BOX_BLUR 3", "GAUSSIAN 3"};
+		for (int k = 0; k < 6; k++) {
+			char name[64];
+			snprintf(name, sizeof(name), "APPLY %s", kernels[k]);
+			bench_case(image, 1, format, name, NULL, name);
+		}
+	}
+
+	// CROP keeps the middle of the image, the selection ROTATE a square
+	// of half the smallest side.
+	char select[128];
+	snprintf(select, sizeof(select), "SELECT %d %d %d %d", width / 4,
+			 height / 4, width - width / 4, height - height / 4);
+	bench_case(image, 1, format, "CROP", select, "CROP");
+	bench_case(image, 1, format, "ROTATE full", NULL, "ROTATE 90");
+	int side = (width < height ? width : height) / 2;
+	snprintf(select, sizeof(select), "SELECT 0 0 %d %d", side, side);
+	bench_case(image, 1, format, "ROTATE selection", select, "ROTATE 90");
+
+	unlink(input);
+	unlink(output);
+}
+
+// ===========================
+// COMPARISONS
+// ===========================
+
+void compare_isa(image_struct *image, char *format)
+{
+	// Every kernel with every instruction set we have, checked against the
+	// double code.
+	char *isa_names[] = {"double", "scalar", "sse2", "avx2"};
+	image_struct *result = copy_image(image);
+	image_struct *reference = copy_image(image);
+	for (int k = 0; k < NR_NAMED_KERNELS; k++)
+		for (int isa = ISA_DOUBLE; isa <= options.isa; isa++) {
+			stage_struct stage;
+			make_stage(&stage, named_kernels[k].mat, isa);
+			double times[BENCH_WARMUP + NMAX_BENCH_RUNS];
+			for (int run = 0; run < BENCH_WARMUP + bench.runs; run++) {
+				double start = clock_seconds(CLOCK_MONOTONIC);
+				convolve(image, result, &stage, 1, isa);
+				times[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+			}
+			char name[64];
+			snprintf(name, sizeof(name), "%s %s", named_kernels[k].name,
+					 isa_names[isa + 1]);
+			if (isa == ISA_DOUBLE) {
+				memcpy(reference->data, result->data,
+					   result->stride * result->height);
+				bench_report(format, image, name, times, NULL);
+			} else {
+				bench_report(format, image, name, times,
+							 same_pixels(reference, result));
+			}
+		}
+	free_img(result);
+	free_img(reference);
+}
+
+void compare_threads(image_struct *image, char *format)
+{
+	// GAUSSIAN_BLUR with 1, 2, 4, ... threads, up to the number of threads
+	// we were given: the pixels must always be the same.
+	image_struct *result = copy_image(image);
+	image_struct *reference = copy_image(image);
+	int max_threads = options.threads;
+	stage_struct stage;
+	make_stage(&stage, named_kernels[3].mat, options.isa);
+	for (int threads = 1;; threads *= 2) {
+		if (threads > max_threads)
+			threads = max_threads;
+		pool_start(threads);
+		double times[BENCH_WARMUP + NMAX_BENCH_RUNS];
+		for (int run = 0; run < BENCH_WARMUP + bench.runs; run++) {
+			double start = clock_seconds(CLOCK_MONOTONIC);
+			convolve(image, result, &stage, 1, options.isa);
+			times[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "GAUSSIAN_BLUR %d threads", threads);
+		if (threads == 1) {
+			memcpy(reference->data, result->data,
+				   result->stride * result->height);
+			bench_report(format, image, name, times, NULL);
+		} else {
+			bench_report(format, image, name, times,
+						 same_pixels(reference, result));
+		}
+		if (threads == max_threads)
+			break;
+	}
+	pool_start(max_threads);
+	free_img(result);
+	free_img(reference);
+}
+
+void compare_fusion(image_struct *image, char *format)
+{
+	// APPLY GAUSSIAN_BLUR SHARPEN EDGE done as three separate passes (each
+	// one with its own copy of the image) and as a single fused pass.
+	stage_struct stages[3];
+	make_stage(&stages[0], named_kernels[3].mat, options.isa);
+	make_stage(&stages[1], named_kernels[1].mat, options.isa);
+	make_stage(&stages[2], named_kernels[0].mat, options.isa);
+
+	double separate[BENCH_WARMUP + NMAX_BENCH_RUNS];
+	double fused[BENCH_WARMUP + NMAX_BENCH_RUNS];
+	image_struct *chained = NULL, *result = NULL;
+	for (int run = 0; run < BENCH_WARMUP + bench.runs; run++) {
+		if (chained)
+			free_img(chained);
+		double start = clock_seconds(CLOCK_MONOTONIC);
+		chained = copy_image(image);
+		for (int k = 0; k < 3; k++) {
+			image_struct *next = copy_image(chained);
+			convolve(chained, next, &stages[k], 1, options.isa);
+			free_img(chained);
+			chained = next;
+		}
+		separate[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+
+		if (result)
+			free_img(result);
+		start = clock_seconds(CLOCK_MONOTONIC);
+		result = copy_image(image);
+		convolve(image, result, stages, 3, options.isa);
+		fused[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+	}
+	bench_report(format, image, "3 kernels separate", separate, NULL);
+	bench_report(format, image, "3 kernels fused", fused,
+				 same_pixels(chained, result));
+	free_img(chained);
+	free_img(result);
+}
+
+void time_big_kernel(image_struct *image, image_struct *result,
+					 big_kernel_struct *kernel, double *times)
+{
+	for (int run = 0; run < BENCH_WARMUP + bench.runs; run++) {
+		double start = clock_seconds(CLOCK_MONOTONIC);
+		convolve_big(image, result, kernel);
+		times[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+	}
+}
+
+void compare_big(image_struct *image, char *format)
+{
+	// BOX_BLUR should take the same time whatever the radius. GAUSSIAN is
+	// timed as two 1-D passes and as a direct 2-D kernel, which must give
+	// the same pixels. The direct kernel costs size * size products per
+	// sample, so it is only timed for the small radii.
+	image_struct *result = copy_image(image);
+	image_struct *reference = copy_image(image);
+	int radii[] = {1, 4, 15, 50};
+	double times[BENCH_WARMUP + NMAX_BENCH_RUNS];
+	char name[64];
+
+	for (int k = 0; k < 4; k++) {
+		big_kernel_struct kernel;
+		big_kernel_box(&kernel, radii[k]);
+		time_big_kernel(image, result, &kernel, times);
+		snprintf(name, sizeof(name), "BOX_BLUR %d", radii[k]);
+		bench_report(format, image, name, times, NULL);
+		free_big_kernel(&kernel);
+	}
+
+	for (int k = 0; k < 2; k++) {
+		big_kernel_struct kernel;
+		if (big_kernel_gaussian(&kernel, radii[k]) == 0)
+			break;
+		time_big_kernel(image, result, &kernel, times);
+		snprintf(name, sizeof(name), "GAUSSIAN %d separable", radii[k]);
+		bench_report(format, image, name, times, NULL);
+		memcpy(reference->data, result->data,
+			   result->stride * result->height);
+
+		// The same kernel, with all its size * size coefficients.
+		int n = kernel.size;
+		kernel.coef = (long long *)malloc((size_t)n * n * sizeof(long long));
+		if (!kernel.coef) {
+			free_big_kernel(&kernel);
+			break;
+		}
+		for (int i = 0; i < n; i++)
+			for (int j = 0; j < n; j++)
+				kernel.coef[i * n + j] = kernel.col[i] * kernel.row[j];
+		kernel.type = BIG_DIRECT;
+		time_big_kernel(image, result, &kernel, times);
+		snprintf(name, sizeof(name), "GAUSSIAN %d direct", radii[k]);
+		bench_report(format, image, name, times,
+					 same_pixels(reference, result));
+		free_big_kernel(&kernel);
+	}
+
+	free_img(result);
+	free_img(reference);
+}
+
+void compare_rotate(image_struct *image, char *format)
+{
+	// ROTATE of the whole image done the old way and in a single pass.
+	int angles[] = {90, 180, 270, -90};
+	for (int a = 0; a < 4; a++) {
+		int turns = ((angles[a] / 90) % 4 + 4) % 4;
+		double old_times[BENCH_WARMUP + NMAX_BENCH_RUNS];
+		double new_times[BENCH_WARMUP + NMAX_BENCH_RUNS];
+		char *check = "exact";
+		for (int run = 0; run < BENCH_WARMUP + bench.runs; run++) {
+			image_struct *old_result = copy_image(image);
+			double start = clock_seconds(CLOCK_MONOTONIC);
+			old_result = rotate_old(old_result, angles[a]);
+			old_times[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+
+			start = clock_seconds(CLOCK_MONOTONIC);
+			image_struct *new_result = full_rotation(image, turns);
+			new_times[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+
+			if (strcmp(same_pixels(old_result, new_result), "exact") != 0)
+				check = "DIFFERENT";
+			free_img(old_result);
+			free_img(new_result);
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "ROTATE %d old", angles[a]);
+		bench_report(format, image, name, old_times, NULL);
+		snprintf(name, sizeof(name), "ROTATE %d", angles[a]);
+		bench_report(format, image, name, new_times, check);
+	}
+}
+
+void compare_histogram(image_struct *image, char *format)
+{
+	// HISTOGRAM with 256 bins, counted the old way and by the threads.
+	long long old_bins[256], new_bins[256];
+	select_struct whole = {0, image->width, 0, image->height};
+	double old_times[BENCH_WARMUP + NMAX_BENCH_RUNS];
+	double new_times[BENCH_WARMUP + NMAX_BENCH_RUNS];
+	for (int run = 0; run < BENCH_WARMUP + bench.runs; run++) {
+		double start = clock_seconds(CLOCK_MONOTONIC);
+		histogram_bins_double(image, 256, old_bins);
+		old_times[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+		start = clock_seconds(CLOCK_MONOTONIC);
+		histogram_bins(image, &whole, 256, new_bins);
+		new_times[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+	}
+	bench_report(format, image, "HISTOGRAM old", old_times, NULL);
+	bench_report(format, image, "HISTOGRAM 256 bins", new_times,
+				 memcmp(old_bins, new_bins, sizeof(old_bins)) == 0
+					 ? "exact" : "DIFFERENT");
+}
+
+void compare_equalize(image_struct *image, char *format)
+{
+	// EQUALIZE done the old way and with the prefix sums and the threads.
+	select_struct whole = {0, image->width, 0, image->height};
+	double old_times[BENCH_WARMUP + NMAX_BENCH_RUNS];
+	double new_times[BENCH_WARMUP + NMAX_BENCH_RUNS];
+	char *check = "exact";
+	for (int run = 0; run < BENCH_WARMUP + bench.runs; run++) {
+		image_struct *old_result = copy_image(image);
+		double start = clock_seconds(CLOCK_MONOTONIC);
+		equalize_quadratic(old_result);
+		old_times[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+
+		image_struct *new_result = copy_image(image);
+		start = clock_seconds(CLOCK_MONOTONIC);
+		void *lut = equalize_lut(new_result, &whole);
+		remap_region(new_result, &whole, lut);
+		free(lut);
+		new_times[run] = clock_seconds(CLOCK_MONOTONIC) - start;
+
+		if (strcmp(same_pixels(old_result, new_result), "exact") != 0)
+			check = "DIFFERENT";
+		free_img(old_result);
+		free_img(new_result);
+	}
+	bench_report(format, image, "EQUALIZE old", old_times, NULL);
+	bench_report(format, image, "EQUALIZE", new_times, check);
+}
+
+void bench_format(char *image_type, int max_value, double megapixels)
+{
+	// A 4:3 image of about "megapixels" million pixels: all the commands,
+	// then, for the binary formats, the comparisons.
+	int width = (int)(sqrt(megapixels * 1e6 * 4 / 3) + 0.5);
+	int height = (int)(megapixels * 1e6 / width + 0.5);
+	if (width < 8)
+		width = 8;
+	if (height < 8)
+		height = 8;
+	image_struct *image = bench_image(image_type, width, height, max_value);
+	if (!image)
+		return;
+	char format[16];
+	snprintf(format, sizeof(format), "%s%s", image_type,
+			 max_value > 255 ? "/16" : "");
+
+	bench_commands(image, format);
+	if (strcmp(image_type, "P5") == 0) {
+		compare_histogram(image, format);
+		compare_equalize(image, format);
+	} else if (strcmp(image_type, "P6") == 0) {
+		compare_isa(image, format);
+		compare_threads(image, format);
+		compare_fusion(image, format);
+		compare_big(image, format);
+		compare_rotate(image, format);
+	}
+	free_img(image);
+}
+
+int main(int argc, char *argv[])
+{
+	// The options of the benchmarks come first, the others are the ones of
+	// the editor (--threads, --isa).
+	char *sizes = "1,10,100", *json = NULL, *label = "";
+	bench.runs = 5;
+	int nr_rest = 1;
+	char **rest = (char **)malloc(argc * sizeof(char *));
+	if (!rest) {
+		fprintf(stderr, "malloc() for options failed\n");
+		return 1;
+	}
+	rest[0] = argv[0];
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc)
+			sizes = argv[++i];
+		else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc &&
+				 atoi(argv[i + 1]) > 0)
+			bench.runs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+			json = argv[++i];
+		else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc)
+			label = argv[++i];
+		else
+			rest[nr_rest++] = argv[i];
+	}
+	int parsed = parse_options(nr_rest, rest);
+	free(rest);
+	if (!parsed) {
+		fprintf(stderr,
+				"       %s [--threads N] [--isa scalar|sse2|avx2] "
+				"[--sizes MP,MP...] [--runs N] [--json FILE] "
+				"[--label TEXT]\n", argv[0]);
+		return 1;
+	}
+	if (bench.runs > NMAX_BENCH_RUNS)
+		bench.runs = NMAX_BENCH_RUNS;
+
+	double megapixels[NMAX_BENCH_SIZES];
+	int nr_sizes = 0;
+	char *list = sizes;
+	while (*list && nr_sizes < NMAX_BENCH_SIZES) {
+		char *end;
+		megapixels[nr_sizes] = strtod(list, &end);
+		if (end == list || megapixels[nr_sizes] <= 0) {
+			fprintf(stderr, "Invalid size in %s\n", sizes);
+			return 1;
+		}
+		nr_sizes++;
+		list = *end == ',' ? end + 1 : end;
+	}
+
+	char *isa_names[] = {"double", "scalar", "sse2", "avx2"};
+	char dir[] = "/tmp/image_editor_bench.XXXXXX";
+	bench.dir = mkdtemp(dir);
+	if (!bench.dir) {
+		fprintf(stderr, "mkdtemp() for the images failed\n");
+		return 1;
+	}
+	if (json) {
+		bench.json = fopen(json, "w");
+		if (!bench.json) {
+			fprintf(stderr, "Failed to open %s\n", json);
+			rmdir(dir);
+			return 1;
+		}
+		fprintf(bench.json,
+				"{\n  \"label\": \"%s\",\n  \"threads\": %d,\n"
+				"  \"isa\": \"%s\",\n  \"runs\": %d,\n  \"warmup\": %d,\n"
+				"  \"results\": [\n",
+				label, options.threads, isa_names[options.isa + 1],
+				bench.runs, BENCH_WARMUP);
+	}
+
+	// The history would keep a copy of every edit, LOAD would be timed from
+	// the cache and SAVE without its writes.
+	options.history = 0;
+	options.cache = 0;
+	options.write_behind = 0;
+	pool_start(options.threads);
+	printf("%-6s%8s  %-24s%12s%12s%12s  check\n", "format", "MP", "command",
+		   "median ms", "p95 ms", "MP/s");
+	char *formats[] = {"P2", "P3", "P5", "P6"};
+	for (int s = 0; s < nr_sizes; s++) {
+		for (int f = 0; f < 4; f++)
+			bench_format(formats[f], 255, megapixels[s]);
+		bench_format("P5", 65535, megapixels[s]);
+		bench_format("P6", 65535, megapixels[s]);
+	}
+	pool_stop();
+
+	if (bench.json) {
+		fprintf(bench.json, "\n  ]\n}\n");
+		fclose(bench.json);
+	}
+	rmdir(dir);
+	return 0;
+}
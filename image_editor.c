@@ -1,10 +1,38 @@
 // Copyright Similea Alin-Andrei 314CA 2022-2023
+#define _POSIX_C_SOURCE 200809L
 #include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#define NMAX_LINE 100
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#else
+#define HAVE_X86_SIMD 0
+#endif
+#define OUT_BUFFER_SIZE (4 << 20)  // bytes gathered before every write()
+
+// The instruction sets the convolution can use, from the slowest. ISA_DOUBLE
+// is the original double code, kept as a reference.
+#define ISA_DOUBLE -1
+#define ISA_SCALAR 0
+#define ISA_SSE2 1
+#define ISA_AVX2 2
 
 // ===========================
 // DATA TYPES
@@ -19,39 +47,340 @@ struct select_struct {
 
 typedef struct select_struct select_struct;
 
-struct pixel_struct {
-	int grayscale;
-	int r;
-	int g;
-	int b;
+struct mapping_struct {
+	unsigned char *base;  // the whole file, mapped in memory
+	size_t size;
+	dev_t dev;	// to recognize the file when we save over it
+	ino_t ino;
 };
 
-typedef struct pixel_struct pixel_struct;
+typedef struct mapping_struct mapping_struct;
+
+struct buffer_struct {
+	unsigned char *base;	  // our own pixels, from spare_get()
+	size_t size;			  // bytes of base, 0 if it is too small to keep
+	mapping_struct *mapping;  // or the mapped file the pixels are in
+	int refs;	// how many images have their pixels in this buffer
+};
+
+typedef struct buffer_struct buffer_struct;
 
 struct image_struct {
 	char image_type[3];
 	int height;
 	int width;
 	int max_value;
-	pixel_struct **pixel;
+	int channels;  // samples per pixel: 1 (grayscale) or 3 (r, g, b)
+	int depth;	   // bytes per sample: 1 if max_value < 256, 2 otherwise
+	size_t stride;		  // bytes between the starts of two consecutive rows
+	unsigned char *data;  // height rows of width * channels samples each
+	buffer_struct *buffer;	// where data points, maybe shared with others
 	select_struct *select;
 };
 
 typedef struct image_struct image_struct;
 
+// The words of a command line, read one after the other.
+struct words_struct {
+	char **word;
+	int nr_words, size;
+	int pos;  // the next word to read
+};
+
+typedef struct words_struct words_struct;
+
+// A command line, parsed once before it is run.
+struct instr_struct {
+	int opcode;	  // CMD_*, or -1 for a line that is not a command
+	int invalid;  // what is wrong with the parameters, printed when run
+	int args[4];  // the numbers of SELECT, HISTOGRAM, ROTATE and THREADS
+	int flag;	  // SELECT ALL, SELECTION, SAVE ascii
+	char *path;	  // the file of LOAD and SAVE
+	char *name;	  // LOAD ... AS name, USE name
+	struct op_struct *op;  // APPLY: the kernels, ready to be copied
+	int stream;	 // SAVE: the image is not used after it ("mark_streams")
+};
+
+typedef struct instr_struct instr_struct;
+
+struct options_struct {
+	int verbose;  // print details about the work done on stderr
+	int isa;	  // the best instruction set we are allowed to use (ISA_*)
+	int threads;  // how many threads share the work of a command
+	int explain;  // print on stderr how the APPLY commands are done
+	int history;  // MB of memory the UNDO history can keep, 0 for none
+	int look_ahead;	 // read a script from a pipe in chunks, like a file
+	char *batch;  // the script run on every input, or NULL
+	int jobs;	  // worker processes of --batch
+	char *out_dir;	 // where the SAVE commands of --batch write
+	char **inputs;	 // the images of --batch
+	int nr_inputs;
+	int spare;			// MB of freed pixel buffers kept for the next images
+	int cache;			// MB of decoded images kept for the next LOAD
+	int stream;			// write the last SAVE of an image band by band
+	int prefetch;		// decode the next LOAD of a script in advance
+	int write_behind;	// SAVE leaves the writes to a thread
+	int stats;			// measure every command, for STATS
+	char *trace;		// where the Chrome trace of the commands goes, or NULL
+};
+
+typedef struct options_struct options_struct;
+
+// The options given in the command line.
+options_struct options;
+
+// What the commands have done since the program started. They only add to it,
+// so the difference around a command is what it did.
+struct counters_struct {
+	long long read;		  // bytes of the files loaded
+	long long written;	  // bytes of the files saved
+	long long pixels;	  // pixels the commands worked on
+	long long allocated;  // bytes allocated for pixels
+};
+
+typedef struct counters_struct counters_struct;
+
+counters_struct counters;
+
 // ===========================
-// ALLOCATION FUNCTIONS
+// COMMAND WORDS
+// ===========================
+
+int split_words(char *line, words_struct *words)
+{
+	// Cuts the line in words, in place: they are separated by spaces and
+	// the end of the line, like the commands have always been read.
+	words->nr_words = 0;
+	words->pos = 0;
+	char *p = line;
+	while (*p) {
+		while (*p == ' ' || *p == '\n')
+			*p++ = '\0';
+		if (!*p)
+			break;
+		if (words->nr_words == words->size) {
+			int size = words->size ? 2 * words->size : 16;
+			char **aux = (char **)realloc(words->word, size * sizeof(char *));
+			if (!aux) {
+				fprintf(stderr, "realloc() for words failed\n");
+				return 0;
+			}
+			words->word = aux;
+			words->size = size;
+		}
+		words->word[words->nr_words++] = p;
+		while (*p && *p != ' ' && *p != '\n')
+			p++;
+	}
+	return 1;
+}
+
+char *next_word(words_struct *words)
+{
+	// NULL when the line has no more words.
+	if (words->pos == words->nr_words)
+		return NULL;
+	return words->word[words->pos++];
+}
+
+// ===========================
+// PIXEL ACCESS
+// ===========================
+
+int image_channels(char *image_type)
+{
+	// Colour images keep three samples per pixel (r, g, b), grayscale ones
+	// keep only one.
+	if (strcmp(image_type, "P3") == 0 || strcmp(image_type, "P6") == 0)
+		return 3;
+	return 1;
+}
+
+int sample_depth(int max_value)
+{
+	// The number of bytes needed to store a sample that can go up to
+	// max_value.
+	if (max_value < 256)
+		return 1;
+	return 2;
+}
+
+static inline unsigned char *row_ptr(image_struct *image, int i)
+{
+	return image->data + (size_t)i * image->stride;
+}
+
+static inline int pixel_size(image_struct *image)
+{
+	return image->channels * image->depth;
+}
+
+static inline unsigned char *pixel_ptr(image_struct *image, int i, int j)
+{
+	return row_ptr(image, i) + (size_t)j * pixel_size(image);
+}
+
+static inline void copy_pixel(unsigned char *dst, unsigned char *src,
+							  int psize)
+{
+	// A pixel takes 1, 2, 3 or 6 bytes. Copying it with a known size lets the
+	// compiler turn it into a couple of moves instead of a memcpy() call.
+	switch (psize) {
+		case 1:
+			dst[0] = src[0];
+			break;
+		case 3:
+			memcpy(dst, src, 3);
+			break;
+		case 2:
+			memcpy(dst, src, 2);
+			break;
+		default:
+			memcpy(dst, src, 6);
+	}
+}
+
+static inline int get_sample(image_struct *image, int i, int j, int c)
+{
+	// Returns the c-th sample (0 for grayscale or r, 1 for g, 2 for b) of the
+	// pixel found on line i and column j.
+	size_t pos = (size_t)j * image->channels + c;
+	if (image->depth == 1)
+		return row_ptr(image, i)[pos];
+	return ((uint16_t *)row_ptr(image, i))[pos];
+}
+
+static inline void set_sample(image_struct *image, int i, int j, int c,
+							  int value)
+{
+	size_t pos = (size_t)j * image->channels + c;
+	if (image->depth == 1)
+		row_ptr(image, i)[pos] = (unsigned char)value;
+	else
+		((uint16_t *)row_ptr(image, i))[pos] = (uint16_t)value;
+}
+
 // ===========================
+// SPARE BUFFERS
+// ===========================
+
+// Almost every command makes a new image of the same size as the one it
+// frees. Instead of giving the pixels back to malloc() every time, the freed
+// buffers are kept by size class for the next image: a class holds the sizes
+// from (4 + k) << shift to (5 + k) << shift bytes, so a buffer is at most 25%
+// larger than needed.
+#define MIN_SPARE_SIZE (64 << 10)  // smaller buffers are left to malloc()
+#define NR_SIZE_CLASSES 256
+
+struct spares_struct {
+	void *lists[NR_SIZE_CLASSES];  // the first bytes of a buffer link the next
+	size_t kept;				   // bytes of all the buffers in the lists
+	long long hits, misses;		   // spare_get() with and without a buffer
+	long long released;			   // bytes freed to stay under the limit
+	pthread_mutex_t lock;  // the loader thread (see PREFETCH) allocates too
+};
+
+typedef struct spares_struct spares_struct;
+
+spares_struct spares = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+size_t size_class(size_t size, int *index)
+{
+	// Returns the size of the class of size (at least MIN_SPARE_SIZE).
+	int shift = 0;
+	while (((size_t)8 << shift) < size)
+		shift++;
+	size_t units = (size + ((size_t)1 << shift) - 1) >> shift;	// 5 to 8
+	*index = shift * 4 + (int)units - 5;
+	return units << shift;
+}
+
+void spare_drop(int index)
+{
+	// Gives the first buffer of a list back to malloc(). The lock must be
+	// held.
+	void *buffer = spares.lists[index];
+	size_t size = (size_t)(5 + index % 4) << (index / 4);
+	spares.lists[index] = *(void **)buffer;
+	spares.kept -= size;
+	spares.released += size;
+	free(buffer);
+}
+
+unsigned char *spare_get(size_t needed, size_t *size)
+{
+	// Returns a buffer of at least needed bytes, a spare one if there is any.
+	// *size becomes its real size, or 0 if it is too small to be kept.
+	if (needed < MIN_SPARE_SIZE) {
+		*size = 0;
+		pthread_mutex_lock(&spares.lock);
+		counters.allocated += needed;
+		pthread_mutex_unlock(&spares.lock);
+		return (unsigned char *)malloc(needed ? needed : 1);
+	}
+	int index;
+	*size = size_class(needed, &index);
+	pthread_mutex_lock(&spares.lock);
+	void *buffer = spares.lists[index];
+	if (buffer) {
+		spares.lists[index] = *(void **)buffer;
+		spares.kept -= *size;
+		spares.hits++;
+		pthread_mutex_unlock(&spares.lock);
+		return (unsigned char *)buffer;
+	}
+	spares.misses++;
+	pthread_mutex_unlock(&spares.lock);
+	buffer = malloc(*size);
+	if (buffer) {
+		pthread_mutex_lock(&spares.lock);
+		counters.allocated += *size;
+		pthread_mutex_unlock(&spares.lock);
+	}
+	return (unsigned char *)buffer;
+}
 
-void free_pixel(pixel_struct **pixel, int nr_lin)
+void spare_put(unsigned char *buffer, size_t size)
 {
-	// Deallocates the matrix of pixels from the image struct
-	for (int i = 0; i < nr_lin; i++)
-		free(pixel[i]);
+	// Keeps a freed buffer for the next image. Above the limit, the buffers
+	// of the other sizes are freed first, from the largest, then this one.
+	if (size == 0) {
+		free(buffer);
+		return;
+	}
+	size_t limit = (size_t)options.spare << 20;
+	int index;
+	size_class(size, &index);
+	pthread_mutex_lock(&spares.lock);
+	for (int k = NR_SIZE_CLASSES - 1; k >= 0 && spares.kept + size > limit;
+		 k--)
+		while (k != index && spares.lists[k] && spares.kept + size > limit)
+			spare_drop(k);
+	if (spares.kept + size > limit) {
+		spares.released += size;
+		pthread_mutex_unlock(&spares.lock);
+		free(buffer);
+		return;
+	}
+	*(void **)buffer = spares.lists[index];
+	spares.lists[index] = buffer;
+	spares.kept += size;
+	pthread_mutex_unlock(&spares.lock);
+}
 
-	free(pixel);
+void spare_free_all(void)
+{
+	pthread_mutex_lock(&spares.lock);
+	for (int k = 0; k < NR_SIZE_CLASSES; k++)
+		while (spares.lists[k])
+			spare_drop(k);
+	pthread_mutex_unlock(&spares.lock);
 }
 
+// ===========================
+// ALLOCATION FUNCTIONS
+// ===========================
+
 int array_alloc(int **v, int n)
 {
 	int *w = (int *)malloc(n * sizeof(int));
@@ -64,28 +393,43 @@ int array_alloc(int **v, int n)
 	return 1;
 }
 
-int pixel_alloc(pixel_struct ***pixel, int nr_lin, int nr_col)
+buffer_struct *buffer_new(unsigned char *base, size_t size,
+						  mapping_struct *mapping)
+{
+	// A buffer used by a single image for now. It owns either base (of size
+	// bytes, from spare_get()) or the mapping.
+	buffer_struct *buffer = (buffer_struct *)malloc(sizeof(buffer_struct));
+	if (!buffer) {
+		fprintf(stderr, "malloc() for buffer failed\n");
+		return NULL;
+	}
+	buffer->base = base;
+	buffer->size = size;
+	buffer->mapping = mapping;
+	buffer->refs = 1;
+	return buffer;
+}
+
+int pixel_alloc(image_struct *image)
 {
-	// Allocates the matrix of pixels from the image struct
-	pixel_struct **m = (pixel_struct **)malloc(nr_lin * sizeof(pixel_struct *));
-	if (!m) {  // if allocation fails, stop
+	// Allocates the pixels of the image as a single contiguous buffer. The
+	// image type, height, width and max_value must already be set, because
+	// they decide how many bytes a row takes.
+	image->channels = image_channels(image->image_type);
+	image->depth = sample_depth(image->max_value);
+	image->stride = (size_t)image->width * pixel_size(image);
+
+	size_t size;
+	image->data = spare_get(image->stride * image->height, &size);
+	if (!image->data) {	 // if allocation fails, stop
 		fprintf(stderr, "malloc() for pixel failed\n");
-		*pixel = NULL;
 		return 0;
 	}
-
-	*pixel = m;
-
-	for (int i = 0; i < nr_lin; i++) {
-		m[i] = (pixel_struct *)malloc(nr_col * sizeof(pixel_struct));
-		if (!m[i]) {
-			// if one of the allocations fails, we deallocate what we previously
-			// allocated
-			fprintf(stderr, "malloc() for line %d failed\n", i);
-			free_pixel(m, i);
-			*pixel = NULL;
-			return 0;
-		}
+	image->buffer = buffer_new(image->data, size, NULL);
+	if (!image->buffer) {
+		spare_put(image->data, size);
+		image->data = NULL;
+		return 0;
 	}
 	return 1;
 }
@@ -100,6 +444,9 @@ int image_alloc(image_struct **image)
 		return 0;
 	}
 
+	img->data = NULL;
+	img->buffer = NULL;
+	img->select = NULL;
 	*image = img;
 	return 1;
 }
@@ -118,280 +465,862 @@ int select_alloc(select_struct **select)
 	return 1;
 }
 
+void unmap_file(mapping_struct *mapping)
+{
+	munmap(mapping->base, mapping->size);
+	free(mapping);
+}
+
+void free_data(image_struct *image)
+{
+	// The image stops using its buffer. The last image that used it frees
+	// the pixels, which are either our own or a part of a mapped file.
+	buffer_struct *buffer = image->buffer;
+	if (buffer && --buffer->refs == 0) {
+		if (buffer->mapping)
+			unmap_file(buffer->mapping);
+		else
+			spare_put(buffer->base, buffer->size);
+		free(buffer);
+	}
+	image->buffer = NULL;
+	image->data = NULL;
+}
+
 void free_img(image_struct *image)
 {
 	// Deallocate the memory of an image and its elements.
 	free(image->select);
-	for (int i = 0; i < image->height; i++)
-		free(image->pixel[i]);
-
-	free(image->pixel);
+	free_data(image);
 	free(image);
 }
 
-// =============================
-// FUNCTIONS THAT DEAL WITH DATA
-// =============================
-
-int load_binary(image_struct *image, char *file_path, long file_pos)
+int own_data(image_struct *image)
 {
-	FILE *pf = fopen(file_path, "rb");
-	if (!pf) {
-		printf("Failed to load %s\n", file_path);
+	// Copies the pixels of the image into a buffer of its own, without the
+	// gaps a view has between its lines, and stops using the old buffer (a
+	// mapped file or the buffer of another image).
+	size_t row_bytes = (size_t)image->width * pixel_size(image);
+	size_t size;
+	unsigned char *data = spare_get(row_bytes * image->height, &size);
+	if (!data) {
+		fprintf(stderr, "malloc() for pixel failed\n");
 		return 0;
 	}
-
-	// Reposition the cursor in file in order to read from where we left off.
-	fseek(pf, file_pos, 0);
-
-	// grayscale
-	if (strcmp(image->image_type, "P5") == 0) {
-		for (int i = 0; i < image->height; i++) {
-			// The elements in the binary file are of type char, so we need to
-			// read them accordingly. It's easier to do it as an array.
-			unsigned char *v_aux =
-				(unsigned char *)malloc(sizeof(unsigned char) * image->width);
-			if (!v_aux) {
-				fprintf(stderr, "malloc() for array failed\n");
-				return 0;
-			}
-			fread(v_aux, sizeof(unsigned char), image->width, pf);
-
-			for (int j = 0; j < image->width; j++)
-				// Transform the chars in integers
-				image->pixel[i][j].grayscale = (int)(v_aux[j]);
-
-			free(v_aux);
-		}
-	}
-
-	// colour
-	if (strcmp(image->image_type, "P6") == 0) {
-		for (int i = 0; i < image->height; i++) {
-			for (int j = 0; j < image->width; j++) {
-				// Here, we can't use an array as we previously did for
-				// grayscale images, because we have one r, one g and one b
-				// values at a time. It's easier to read them separately.
-				unsigned char r, g, b;
-				fread(&r, sizeof(unsigned char), 1, pf);
-				fread(&g, sizeof(unsigned char), 1, pf);
-				fread(&b, sizeof(unsigned char), 1, pf);
-				image->pixel[i][j].r = (int)r;
-				image->pixel[i][j].g = (int)g;
-				image->pixel[i][j].b = (int)b;
-			}
-		}
+	buffer_struct *buffer = buffer_new(data, size, NULL);
+	if (!buffer) {
+		spare_put(data, size);
+		return 0;
 	}
-	fclose(pf);
+	for (int i = 0; i < image->height; i++)
+		memcpy(data + (size_t)i * row_bytes, row_ptr(image, i), row_bytes);
+	free_data(image);
+	image->data = data;
+	image->buffer = buffer;
+	image->stride = row_bytes;
 	return 1;
 }
 
-image_struct *load(image_struct *image_test, int *loaded_img_now, char *delim)
+int unshare_data(image_struct *image)
 {
-	// The file_path is the next word from previously read line in main.
-	char *file_path = strtok(NULL, delim);
+	// Must be called before the pixels of the image are changed in place:
+	// if other images (views) still use the same buffer, the image gets a
+	// copy of its own first (copy on write). The pages of a mapped file are
+	// already copied by the kernel when they are first written.
+	if (image->buffer->refs > 1)
+		return own_data(image);
+	return 1;
+}
 
-	if (!file_path) {
-		printf("Invalid command\n");
-		return NULL;
-	}
-	if (*(loaded_img_now) == 1) {
-		free_img(image_test);
-		(*loaded_img_now)--;
+// ===========================
+// THREAD POOL
+// ===========================
+
+struct pool_struct {
+	pthread_t *workers;
+	int nr_workers;	 // the main thread works too, so threads - 1 of them
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	void (*task)(void *arg, int index);
+	void *arg;
+	int nr_tasks;
+	int next_task;	// the first task nobody has taken yet
+	int done_tasks;
+	int stop;
+};
+
+typedef struct pool_struct pool_struct;
+
+// The workers shared by all the commands.
+pool_struct pool;
+
+int pool_take_task(void)
+{
+	// Returns the index of a task that is not taken yet, or -1. The lock must
+	// be held.
+	if (!pool.task || pool.next_task >= pool.nr_tasks)
+		return -1;
+	return pool.next_task++;
+}
+
+void pool_work(void)
+{
+	// Runs tasks until there are none left. Called with the lock held.
+	int index;
+	while ((index = pool_take_task()) >= 0) {
+		pthread_mutex_unlock(&pool.lock);
+		pool.task(pool.arg, index);
+		pthread_mutex_lock(&pool.lock);
+		if (++pool.done_tasks == pool.nr_tasks)
+			pthread_cond_signal(&pool.work_done);
 	}
-	FILE *pf = fopen(file_path, "rt");
-	if (!pf) {
-		printf("Failed to load %s\n", file_path);
-		return NULL;
+}
+
+void *pool_worker(void *unused)
+{
+	(void)unused;
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.stop) {
+		pool_work();
+		pthread_cond_wait(&pool.work_ready, &pool.lock);
 	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
 
-	image_struct *image;
-	if (image_alloc(&image) == 0)
-		return NULL;
+void pool_stop(void)
+{
+	// Wakes up the workers, waits for them to end and frees them.
+	if (pool.nr_workers == 0)
+		return;
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.work_ready);
+	pthread_mutex_unlock(&pool.lock);
+	for (int i = 0; i < pool.nr_workers; i++)
+		pthread_join(pool.workers[i], NULL);
+	free(pool.workers);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.work_ready);
+	pthread_cond_destroy(&pool.work_done);
+	pool.nr_workers = 0;
+}
 
-	char buffer[NMAX_LINE];
-	int values[5];
-	for (int i = 1; i <= 4;) {	// loop until we read 4 elements
-		fscanf(pf, "%s", buffer);
-		if (strchr(buffer, '#')) {	// skip comments
-			fgets(buffer, NMAX_LINE, pf);
-			continue;
-		}
-		if (i == 1) {
-			strncpy(image->image_type, buffer, 2);
-			image->image_type[2] = '\0';
+void pool_start(int threads)
+{
+	// Starts threads - 1 workers. If something fails, we go on with the ones
+	// we already have (at worst, only with the main thread).
+	pool_stop();
+	pool.task = NULL;
+	pool.stop = 0;
+	if (threads <= 1)
+		return;
+	pool.workers = (pthread_t *)malloc((threads - 1) * sizeof(pthread_t));
+	if (!pool.workers) {
+		fprintf(stderr, "malloc() for workers failed\n");
+		return;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work_ready, NULL);
+	pthread_cond_init(&pool.work_done, NULL);
+	for (int i = 0; i < threads - 1; i++) {
+		if (pthread_create(&pool.workers[i], NULL, pool_worker, NULL) != 0) {
+			fprintf(stderr, "pthread_create() failed\n");
+			break;
 		}
-		values[i] = atoi(buffer);
-		i++;
+		pool.nr_workers++;
 	}
-
-	image->width = values[2];
-	image->height = values[3];
-	image->max_value = values[4];
-	if (pixel_alloc(&image->pixel, image->height, image->width) == 0)
-		return NULL;
-
-	if (strcmp(image->image_type, "P2") == 0 ||
-		strcmp(image->image_type, "P3") == 0) {
-		// ASCII grayscale
-		if (strcmp(image->image_type, "P2") == 0)
-			for (int i = 0; i < image->height; i++)
-				for (int j = 0; j < image->width; j++)
-					fscanf(pf, "%d", &image->pixel[i][j].grayscale);
-		// Colour
-		if (strcmp(image->image_type, "P3") == 0)
-			for (int i = 0; i < image->height; i++)
-				for (int j = 0; j < image->width; j++)
-					fscanf(pf, "%d%d%d", &image->pixel[i][j].r,
-						   &image->pixel[i][j].g, &image->pixel[i][j].b);
-	}
-
-	if (strcmp(image->image_type, "P5") == 0 ||
-		strcmp(image->image_type, "P6") == 0) {
-		// Binary
-		char character;
-		fscanf(pf, "%c", &character);  // skip a "\n"
-		long file_pos = ftell(pf);	// memorize the position to read from here
-		fclose(pf);
-		if (load_binary(image, file_path, file_pos) == 0)
-			return NULL;
+	if (pool.nr_workers == 0) {
+		free(pool.workers);
+		pthread_mutex_destroy(&pool.lock);
+		pthread_cond_destroy(&pool.work_ready);
+		pthread_cond_destroy(&pool.work_done);
 	}
+}
 
-	if (select_alloc(&image->select) == 0)
-		return NULL;
-	image->select->x1 = 0;	// the regular selection of the whole image
-	image->select->x2 = image->width;
-	image->select->y1 = 0;
-	image->select->y2 = image->height;
+void pool_run(void (*task)(void *arg, int index), void *arg, int nr_tasks)
+{
+	// Runs task(arg, 0), ..., task(arg, nr_tasks - 1) on all the threads and
+	// returns when all of them are done. The tasks must not depend on each
+	// other, so the result doesn't depend on which thread ran what.
+	if (pool.nr_workers == 0 || nr_tasks <= 1) {
+		for (int index = 0; index < nr_tasks; index++)
+			task(arg, index);
+		return;
+	}
 
-	printf("Loaded %s\n", file_path);
-	(*loaded_img_now)++;
-	return image;
+	pthread_mutex_lock(&pool.lock);
+	pool.task = task;
+	pool.arg = arg;
+	pool.nr_tasks = nr_tasks;
+	pool.next_task = 0;
+	pool.done_tasks = 0;
+	pthread_cond_broadcast(&pool.work_ready);
+	pool_work();
+	while (pool.done_tasks < pool.nr_tasks)
+		pthread_cond_wait(&pool.work_done, &pool.lock);
+	pool.task = NULL;
+	pthread_mutex_unlock(&pool.lock);
 }
 
-image_struct *copy_image(image_struct *initial)
+int pool_bands(int nr_rows, int min_rows)
 {
-	// Makes a copy of the initial image.
-	image_struct *copy;
-	if (image_alloc(&copy) == 0)
-		return NULL;
+	// How many bands of at least min_rows rows we split nr_rows rows into,
+	// about 4 for every thread so that they finish at the same time.
+	int bands = (pool.nr_workers + 1) * 4;
+	if (bands > nr_rows / min_rows)
+		bands = nr_rows / min_rows;
+	return bands > 1 ? bands : 1;
+}
 
-	strcpy(copy->image_type, initial->image_type);
-	copy->height = initial->height;
-	copy->width = initial->width;
-	copy->max_value = initial->max_value;
+// =============================
+// FUNCTIONS THAT DEAL WITH DATA
+// =============================
 
-	if (pixel_alloc(&copy->pixel, copy->height, copy->width) == 0)
+mapping_struct *map_file(char *file_path)
+{
+	// Maps the whole file in memory. The mapping is private and writable, so
+	// the first edit of a page makes the kernel copy it, leaving the file
+	// untouched.
+	int fd = open(file_path, O_RDONLY);
+	if (fd < 0)
 		return NULL;
-	for (int i = 0; i < copy->height; i++)
-		for (int j = 0; j < copy->width; j++)
-			copy->pixel[i][j] = initial->pixel[i][j];
 
-	if (select_alloc(&copy->select) == 0)
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
 		return NULL;
-	copy->select->x1 = initial->select->x1;
-	copy->select->x2 = initial->select->x2;
-	copy->select->y1 = initial->select->y1;
-	copy->select->y2 = initial->select->y2;
+	}
 
-	return copy;
+	mapping_struct *mapping = (mapping_struct *)malloc(sizeof(mapping_struct));
+	if (!mapping) {
+		fprintf(stderr, "malloc() for mapping failed\n");
+		close(fd);
+		return NULL;
+	}
+	mapping->size = (size_t)st.st_size;
+	mapping->dev = st.st_dev;
+	mapping->ino = st.st_ino;
+	mapping->base = (unsigned char *)mmap(NULL, mapping->size,
+										  PROT_READ | PROT_WRITE, MAP_PRIVATE,
+										  fd, 0);
+	close(fd);	// the mapping stays valid after the file is closed
+	if (mapping->base == MAP_FAILED) {
+		free(mapping);
+		return NULL;
+	}
+	posix_madvise(mapping->base, mapping->size, POSIX_MADV_SEQUENTIAL);
+	return mapping;
 }
 
-int validate_selection(image_struct *image, int x1, int y1, int x2, int y2)
+int same_file(struct stat *a, struct stat *b)
 {
-	// Verifies if the coordinates are inside the image's borders.
-	if (x1 < 0 || x1 > image->width || x2 < 0 || x2 > image->width)
-		return 0;
-	if (y1 < 0 || y1 > image->height || y2 < 0 || y2 > image->height)
-		return 0;
-	int kon = 1;
-
-	// Verifies how many coordinates have the same value.
-	// There must be less than 3 to be a valid selection.
-	// Otherwise, there will be no elements in the selection.
-	int val[4] = {x1, x2, y1, y2};
-	for (int i = 0; i < 4; i++) {
-		kon = 1;
-		for (int j = i + 1; j < 4; j++)
-			if (val[i] == val[j])
-				kon++;
-		if (kon >= 3)
-			return 0;
-	}
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+		   a->st_size == b->st_size &&
+		   a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		   a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
 
-	// Verifies how many coordinates have the same value as the upper borders of
-	// the image (width and height).There must be less than 3 to be a valid
-	// selection. Otherwise, there will be no elements in the selection.
-	kon = 0;
-	for (int i = 0; i < 4; i++) {
-		if (val[i] == image->height || val[i] == image->width)
-			kon++;
-	}
-	if (kon >= 3)
-		return 0;
+static inline int is_blank(unsigned char c)
+{
+	// The whitespace characters of the PNM format: " ", "\t", "\n", "\v",
+	// "\f" and "\r".
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
 
-	return 1;
+static inline int is_digit(unsigned char c)
+{
+	return (unsigned char)(c - '0') < 10;
 }
 
-void select_all(image_struct *image)
+static inline size_t skip_comment(unsigned char *buf, size_t size, size_t pos)
 {
-	// Selects the whole image.
-	image->select->x1 = 0;
-	image->select->x2 = image->width;
-	image->select->y1 = 0;
-	image->select->y2 = image->height;
-	printf("Selected ALL\n");
+	// A comment starts with a "#" anywhere and goes until the end of the
+	// line, which is skipped too.
+	unsigned char *eol = memchr(buf + pos, '\n', size - pos);
+	return eol ? (size_t)(eol - buf) + 1 : size;
 }
 
-void select_image(image_struct *image, int loaded_img_now, char *delim)
+static inline size_t skip_separators(unsigned char *buf, size_t size, size_t pos)
 {
-	if (loaded_img_now == 0) {
-		printf("No image loaded\n");
-		return;
+	// Skips the whitespace and the comments.
+	while (pos < size) {
+		if (is_blank(buf[pos]))
+			pos++;
+		else if (buf[pos] == '#')
+			pos = skip_comment(buf, size, pos);
+		else
+			break;
 	}
+	return pos;
+}
 
-	char *next_elem_in_line = strtok(NULL, delim);
-	if (!next_elem_in_line) {
-		printf("Invalid command\n");
-		return;
-	}
-	if (strcmp(next_elem_in_line, "ALL") == 0) {
-		select_all(image);
-		return;
+int parse_header(image_struct *image, unsigned char *buf, size_t size,
+				 size_t *data_pos)
+{
+	// Reads the 4 elements of the header (image_type, width, height and
+	// max_value) straight from the mapped file. Returns the position where
+	// the pixels start.
+	size_t pos = 0;
+	long values[5];
+	for (int i = 1; i <= 4; i++) {	// loop until we read 4 elements
+		pos = skip_separators(buf, size, pos);
+		if (pos == size)
+			return 0;
+
+		size_t start = pos;
+		while (pos < size && !is_blank(buf[pos]) && buf[pos] != '#')
+			pos++;
+
+		if (i == 1) {
+			if (pos - start != 2)
+				return 0;
+			memcpy(image->image_type, buf + start, 2);
+			image->image_type[2] = '\0';
+		} else {
+			values[i] = 0;
+			for (size_t k = start; k < pos; k++) {
+				if (!is_digit(buf[k]) || values[i] > 100000000)
+					return 0;
+				values[i] = values[i] * 10 + (buf[k] - '0');
+			}
+		}
 	}
 
-	// If we have to execute a normal SELECT, the previously read element will
-	// actually be the first coordinate (x1).
-	char *element[4];
-	element[0] = next_elem_in_line;
-	int number[4];
+	if (strcmp(image->image_type, "P2") != 0 &&
+		strcmp(image->image_type, "P3") != 0 &&
+		strcmp(image->image_type, "P5") != 0 &&
+		strcmp(image->image_type, "P6") != 0)
+		return 0;
+	if (values[2] <= 0 || values[3] <= 0 || values[4] <= 0 ||
+		values[4] > 65535)
+		return 0;
+
+	image->width = values[2];
+	image->height = values[3];
+	image->max_value = values[4];
 
-	// We transform them in integers, because we read them as chars.
-	number[0] = atoi(element[0]);
-	char *next;
-	int i = 1;
+	// A single whitespace separates max_value from the pixels, or a comment
+	// right after it, whose end of line is that whitespace. The pixels of a
+	// binary image can be any byte, so nothing else is skipped.
+	if (pos < size && buf[pos] == '#')
+		*data_pos = skip_comment(buf, size, pos);
+	else
+		*data_pos = pos < size ? pos + 1 : pos;
+	return 1;
+}
 
-	for (i = 1; i < 4; i++) {  // We need to have 4 elements(x1, y1, x2, y2)
-		next = strtok(NULL, delim);
-		if (!next) {  // 4 elements have not been found
-			printf("Invalid command\n");
-			return;
+int load_text(image_struct *image, unsigned char *buf, size_t size,
+			  size_t pos, FILE *errors)
+{
+	// Reads the samples of a P2 or P3 image, written as decimal numbers
+	// separated by whitespace or comments, straight into the pixel buffer.
+	// Every sample must be in [0, max_value] and there must be exactly
+	// width * height * channels of them. What is wrong goes to "errors".
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t first_pos = pos;
+
+	size_t samples = (size_t)image->width * image->height * image->channels;
+	unsigned int max_value = image->max_value;
+	for (size_t k = 0; k < samples; k++) {
+		pos = skip_separators(buf, size, pos);
+		if (pos == size) {
+			fprintf(errors, "Only %zu of %zu samples found\n", k, samples);
+			return 0;
 		}
-		int length = strlen(next);
-		for (int k = 0; k < length; k++)
-			if (isalpha(next[k]) != 0) {  // verify they are not letters
-				printf("Invalid command\n");
-				return;
+
+		unsigned int value = 0;
+		size_t start = pos;
+		while (pos < size && is_digit(buf[pos])) {
+			value = value * 10 + (buf[pos] - '0');
+			if (value > max_value) {
+				fprintf(errors, "Sample %zu is greater than %u\n", k,
+						max_value);
+				return 0;
+			}
+			pos++;
+		}
+		// A number has to end with a whitespace, a comment or the file.
+		if (pos == start ||
+			(pos < size && !is_blank(buf[pos]) && buf[pos] != '#')) {
+			fprintf(errors, "Sample %zu is not a number\n", k);
+			return 0;
+		}
+
+		if (image->depth == 1)
+			image->data[k] = (unsigned char)value;
+		else
+			((uint16_t *)image->data)[k] = (uint16_t)value;
+	}
+
+	if (options.verbose) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double seconds = (end.tv_sec - start.tv_sec) +
+						 (end.tv_nsec - start.tv_nsec) / 1e9;
+		double megabytes = (pos - first_pos) / 1e6;
+		fprintf(errors, "Parsed %.1f MB of ASCII samples in %.3f s ",
+				megabytes, seconds);
+		fprintf(errors, "(%.1f MB/s)\n",
+				seconds > 0 ? megabytes / seconds : 0.0);
+	}
+	return 1;
+}
+
+int load_binary(image_struct *image, mapping_struct *mapping, size_t data_pos,
+				FILE *errors)
+{
+	// The samples in the binary file are stored in the order we keep them in
+	// memory (grayscale or r, g, b), on 1 byte if max_value is lower than 256
+	// and on 2 bytes otherwise, the most significant one first.
+	size_t row_samples = (size_t)image->width * image->channels;
+	size_t samples = row_samples * image->height;
+	if (mapping->size < data_pos ||
+		(mapping->size - data_pos) / image->depth < samples)
+		return 0;  // the file is shorter than its header says
+	unsigned char *samples_in_file = mapping->base + data_pos;
+
+	if (image->depth == 1) {
+		// Zero-copy: the pixels are used right from the mapped file.
+		image->buffer = buffer_new(NULL, 0, mapping);
+		if (!image->buffer)
+			return 0;
+		image->data = samples_in_file;
+		return 1;
+	}
+
+	// Otherwise, we swap the bytes of every sample in a single pass into our
+	// own buffer, checking that none of them is greater than max_value.
+	if (pixel_alloc(image) == 0)
+		return 0;
+	uint16_t *data = (uint16_t *)image->data;
+	unsigned int max_sample = 0;
+	for (size_t k = 0; k < samples; k++) {
+		data[k] = (uint16_t)(samples_in_file[2 * k] << 8 |
+							 samples_in_file[2 * k + 1]);
+		max_sample = data[k] > max_sample ? data[k] : max_sample;
+	}
+	if (max_sample > (unsigned int)image->max_value) {
+		fprintf(errors, "A sample is greater than %d\n", image->max_value);
+		return 0;
+	}
+	return 1;
+}
+
+// QOI ("Quite OK Image", qoiformat.org) keeps 8-bit RGB pixels losslessly,
+// as a stream of 1 to 5 byte chunks: a run of the previous pixel, a pixel
+// seen recently (found by a hash in 64 places), a small difference from the
+// previous pixel, or the whole pixel. After the end marker we add "P5" or "P6"
+// and max_value (2 bytes), which other decoders ignore, so that grayscale
+// images and their max_value come back the same.
+#define QOI_HEADER_SIZE 14
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_HASH(r, g, b, a) (((r) * 3 + (g) * 5 + (b) * 7 + (a) * 11) % 64)
+
+const unsigned char qoi_end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+static inline unsigned int read_be32(unsigned char *p)
+{
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+int is_qoi(unsigned char *buf, size_t size)
+{
+	return size >= QOI_HEADER_SIZE + 8 && memcmp(buf, "qoif", 4) == 0;
+}
+
+int load_qoi(image_struct *image, unsigned char *buf, size_t size,
+			 FILE *errors)
+{
+	// Decodes the pixels straight from the mapped file into our buffer, a
+	// sample for every pixel of a grayscale image and 3 for a color one. The
+	// alpha of an RGBA file is dropped.
+	unsigned int width = read_be32(buf + 4), height = read_be32(buf + 8);
+	if (width == 0 || height == 0 || width > 100000000 ||
+		height > 100000000 || (buf[12] != 3 && buf[12] != 4))
+		return 0;
+	size_t end = size - 8;	// where the end marker is
+	strcpy(image->image_type, "P6");
+	image->max_value = 255;
+	unsigned char *trailer = buf + size - 4;
+	if (size >= QOI_HEADER_SIZE + 12 && memcmp(trailer - 8, qoi_end, 8) == 0 &&
+		trailer[0] == 'P' && (trailer[1] == '5' || trailer[1] == '6')) {
+		image->image_type[1] = trailer[1];
+		image->max_value = trailer[2] << 8 | trailer[3];
+		end -= 4;
+	}
+	if (image->max_value == 0 || image->max_value > 255)
+		return 0;
+	image->width = width;
+	image->height = height;
+	if (pixel_alloc(image) == 0)
+		return 0;
+
+	unsigned char index[64][4], px[4] = {0, 0, 0, 255};
+	memset(index, 0, sizeof(index));
+	unsigned char *data = image->data;
+	size_t nr_pixels = (size_t)width * height, pos = QOI_HEADER_SIZE;
+	int gray = image->channels == 1, run = 0;
+	unsigned char max_sample = 0, not_gray = 0;
+	for (size_t k = 0; k < nr_pixels; k++) {
+		if (run > 0) {
+			run--;
+		} else {
+			if (pos >= end)
+				return 0;  // the file is shorter than its header says
+			int op = buf[pos++];
+			if (op == QOI_OP_RGB || op == QOI_OP_RGBA) {
+				int n = op == QOI_OP_RGB ? 3 : 4;
+				if (end - pos < (size_t)n)
+					return 0;
+				memcpy(px, buf + pos, n);
+				pos += n;
+			} else if ((op & 0xc0) == QOI_OP_INDEX) {
+				memcpy(px, index[op], 4);
+			} else if ((op & 0xc0) == QOI_OP_DIFF) {
+				px[0] += ((op >> 4) & 3) - 2;
+				px[1] += ((op >> 2) & 3) - 2;
+				px[2] += (op & 3) - 2;
+			} else if ((op & 0xc0) == QOI_OP_LUMA) {
+				if (pos == end)
+					return 0;
+				int next = buf[pos++];
+				int dg = (op & 0x3f) - 32;
+				px[0] += dg - 8 + ((next >> 4) & 0x0f);
+				px[1] += dg;
+				px[2] += dg - 8 + (next & 0x0f);
+			} else {
+				run = op & 0x3f;
 			}
-		element[i] = next;
-		number[i] = atoi(element[i]);
+			memcpy(index[QOI_HASH(px[0], px[1], px[2], px[3])], px, 4);
+		}
+		if (gray) {
+			data[k] = px[0];
+			not_gray |= (px[0] ^ px[1]) | (px[0] ^ px[2]);
+		} else {
+			memcpy(data + 3 * k, px, 3);
+			max_sample = px[1] > max_sample ? px[1] : max_sample;
+			max_sample = px[2] > max_sample ? px[2] : max_sample;
+		}
+		max_sample = px[0] > max_sample ? px[0] : max_sample;
+	}
+	if (not_gray) {
+		fprintf(errors, "A pixel of a grayscale image is not gray\n");
+		return 0;
+	}
+	if (max_sample > image->max_value) {
+		fprintf(errors, "A sample is greater than %d\n", image->max_value);
+		return 0;
+	}
+	return 1;
+}
+
+image_struct *decode_file(char *file_path, FILE *errors, long long *read)
+{
+	// Maps the file once, parses the header in place and decodes the pixels.
+	// Returns the image with the whole of it selected, or NULL. *read becomes
+	// the size of the file. Nothing is printed on stdout, so that the loader
+	// thread can use it too (see PREFETCH).
+	mapping_struct *mapping = map_file(file_path);
+	if (!mapping)
+		return NULL;
+	*read = mapping->size;
+
+	image_struct *image;
+	if (image_alloc(&image) == 0) {
+		unmap_file(mapping);
+		return NULL;
+	}
+
+	// A QOI image is recognized by its first bytes and decoded whole.
+	size_t data_pos = 0;
+	int qoi = is_qoi(mapping->base, mapping->size);
+	if (qoi ? load_qoi(image, mapping->base, mapping->size, errors) == 0 :
+			  parse_header(image, mapping->base, mapping->size,
+						   &data_pos) == 0) {
+		unmap_file(mapping);
+		free_img(image);
+		return NULL;
+	}
+	image->channels = image_channels(image->image_type);
+	image->depth = sample_depth(image->max_value);
+	image->stride = (size_t)image->width * pixel_size(image);
+
+	if (qoi) {
+		unmap_file(mapping);
+	} else if (strcmp(image->image_type, "P2") == 0 ||
+			   strcmp(image->image_type, "P3") == 0) {
+		// The ASCII pixels are parsed from the mapped file, right after the
+		// header.
+		int parsed = pixel_alloc(image) &&
+					 load_text(image, mapping->base, mapping->size, data_pos,
+							   errors);
+		unmap_file(mapping);
+		if (parsed == 0) {
+			free_img(image);
+			return NULL;
+		}
+	} else {
+		// Binary
+		if (load_binary(image, mapping, data_pos, errors) == 0) {
+			unmap_file(mapping);
+			free_img(image);
+			return NULL;
+		}
+		if (image->buffer->mapping != mapping)	// the pixels were converted
+			unmap_file(mapping);
+	}
+
+	if (select_alloc(&image->select) == 0) {
+		free_img(image);
+		return NULL;
+	}
+	image->select->x1 = 0;	// the regular selection of the whole image
+	image->select->x2 = image->width;
+	image->select->y1 = 0;
+	image->select->y2 = image->height;
+	return image;
+}
+
+// ===========================
+// PREFETCH
+// ===========================
+
+// When a whole script is read first, the file of the next LOAD is decoded by
+// a thread of its own while the commands before it are run ("prefetch_next"),
+// and LOAD only takes the image. What the decoding prints on stderr is kept
+// and printed by LOAD, so the messages come in the same order as without it.
+struct loader_struct {
+	pthread_t thread;
+	int busy;  // a file is decoded, or was and the image is not taken yet
+	instr_struct *instr;  // the LOAD it is decoded for
+	struct stat st;		  // the file before it was decoded
+	image_struct *image;  // NULL if it failed
+	long long read;		  // bytes of the file
+	char *messages;		  // what the decoding printed
+	size_t messages_size;
+};
+
+typedef struct loader_struct loader_struct;
+
+loader_struct loader;
+
+void touch_pages(image_struct *image)
+{
+	// The pixels of a binary image stay in the mapped file: we read a byte of
+	// every page, so that the disk is read here and not by the commands.
+	long page = sysconf(_SC_PAGESIZE);
+	mapping_struct *mapping = image->buffer->mapping;
+	volatile unsigned char *base = mapping->base;
+	for (size_t pos = 0; pos < mapping->size; pos += page)
+		(void)base[pos];
+}
+
+void *loader_work(void *unused)
+{
+	(void)unused;
+	FILE *errors = open_memstream(&loader.messages, &loader.messages_size);
+	if (!errors)
+		return NULL;
+	loader.image = decode_file(loader.instr->path, errors, &loader.read);
+	if (loader.image && loader.image->buffer->mapping)
+		touch_pages(loader.image);
+	fclose(errors);
+	return NULL;
+}
+
+void loader_drop(void)
+{
+	// Waits for the thread and forgets what it decoded.
+	if (!loader.busy)
+		return;
+	pthread_join(loader.thread, NULL);
+	if (loader.image)
+		free_img(loader.image);
+	free(loader.messages);
+	memset(&loader, 0, sizeof(loader));
+}
+
+void loader_start(instr_struct *instr)
+{
+	// Starts decoding the file of a LOAD that will come later.
+	loader_drop();
+	if (stat(instr->path, &loader.st) != 0)
+		return;
+	loader.instr = instr;
+	loader.busy = 1;
+	if (pthread_create(&loader.thread, NULL, loader_work, NULL) != 0) {
+		fprintf(stderr, "pthread_create() failed\n");
+		memset(&loader, 0, sizeof(loader));
+	}
+}
+
+image_struct *loader_take(instr_struct *instr, long long *read)
+{
+	// The image decoded for this LOAD, if the file did not change since, or
+	// NULL: then the file is loaded again, and its problems printed.
+	if (!loader.busy || loader.instr != instr)
+		return NULL;
+	pthread_join(loader.thread, NULL);
+	loader.busy = 0;
+	struct stat st;
+	image_struct *image = NULL;
+	if (loader.image && stat(instr->path, &st) == 0 &&
+		same_file(&st, &loader.st)) {
+		if (loader.messages_size)
+			fwrite(loader.messages, 1, loader.messages_size, stderr);
+		if (options.verbose)
+			fprintf(stderr, "%s was decoded in advance\n", instr->path);
+		image = loader.image;
+		*read = loader.read;
+	} else if (loader.image) {
+		free_img(loader.image);
+	}
+	free(loader.messages);
+	memset(&loader, 0, sizeof(loader));
+	return image;
+}
+
+void loader_forget(struct stat *st)
+{
+	// The file is about to be written over: what was decoded from it would
+	// be out of date, and its mapping would change.
+	if (loader.busy && loader.st.st_dev == st->st_dev &&
+		loader.st.st_ino == st->st_ino)
+		loader_drop();
+}
+
+image_struct *load(image_struct *image_test, int *loaded_img_now,
+				   instr_struct *instr)
+{
+	// The file_path is the word after LOAD.
+	char *file_path = instr->path;
+
+	if (!file_path) {
+		printf("Invalid command\n");
+		return image_test;  // the loaded image (if any) is kept
+	}
+	if (*(loaded_img_now) == 1) {
+		free_img(image_test);
+		(*loaded_img_now)--;
+	}
+
+	long long read = 0;
+	image_struct *image = loader_take(instr, &read);
+	if (!image)
+		image = decode_file(file_path, stderr, &read);
+	counters.read += read;
+	if (!image) {
+		printf("Failed to load %s\n", file_path);
+		return NULL;
+	}
+
+	printf("Loaded %s\n", file_path);
+	counters.pixels += (long long)image->width * image->height;
+	(*loaded_img_now)++;
+	return image;
+}
+
+image_struct *copy_image(image_struct *initial)
+{
+	// Makes a copy of the initial image.
+	image_struct *copy;
+	if (image_alloc(&copy) == 0)
+		return NULL;
+
+	strcpy(copy->image_type, initial->image_type);
+	copy->height = initial->height;
+	copy->width = initial->width;
+	copy->max_value = initial->max_value;
+
+	if (pixel_alloc(copy) == 0)
+		return NULL;
+	for (int i = 0; i < copy->height; i++)
+		memcpy(row_ptr(copy, i), row_ptr(initial, i), copy->stride);
+
+	if (select_alloc(&copy->select) == 0)
+		return NULL;
+	copy->select->x1 = initial->select->x1;
+	copy->select->x2 = initial->select->x2;
+	copy->select->y1 = initial->select->y1;
+	copy->select->y2 = initial->select->y2;
+
+	return copy;
+}
+
+int validate_selection(image_struct *image, int x1, int y1, int x2, int y2)
+{
+	// Verifies if the coordinates are inside the image's borders.
+	if (x1 < 0 || x1 > image->width || x2 < 0 || x2 > image->width)
+		return 0;
+	if (y1 < 0 || y1 > image->height || y2 < 0 || y2 > image->height)
+		return 0;
+	int kon = 1;
+
+	// Verifies how many coordinates have the same value.
+	// There must be less than 3 to be a valid selection.
+	// Otherwise, there will be no elements in the selection.
+	int val[4] = {x1, x2, y1, y2};
+	for (int i = 0; i < 4; i++) {
+		kon = 1;
+		for (int j = i + 1; j < 4; j++)
+			if (val[i] == val[j])
+				kon++;
+		if (kon >= 3)
+			return 0;
+	}
+
+	// Verifies how many coordinates have the same value as the upper borders of
+	// the image (width and height).There must be less than 3 to be a valid
+	// selection. Otherwise, there will be no elements in the selection.
+	kon = 0;
+	for (int i = 0; i < 4; i++) {
+		if (val[i] == image->height || val[i] == image->width)
+			kon++;
+	}
+	if (kon >= 3)
+		return 0;
+
+	return 1;
+}
+
+void select_all(image_struct *image)
+{
+	// Selects the whole image.
+	image->select->x1 = 0;
+	image->select->x2 = image->width;
+	image->select->y1 = 0;
+	image->select->y2 = image->height;
+	printf("Selected ALL\n");
+}
+
+void select_image(image_struct *image, int loaded_img_now,
+				  instr_struct *instr)
+{
+	if (loaded_img_now == 0) {
+		printf("No image loaded\n");
+		return;
+	}
+	if (instr->invalid) {
+		printf("Invalid command\n");
+		return;
+	}
+	if (instr->flag) {	// SELECT ALL
+		select_all(image);
+		return;
 	}
 
 	int x1, y1, x2, y2;
-	x1 = number[0];
-	y1 = number[1];
-	x2 = number[2];
-	y2 = number[3];
+	x1 = instr->args[0];
+	y1 = instr->args[1];
+	x2 = instr->args[2];
+	y2 = instr->args[3];
 
 	// Switch positions if they are not in ascending order (x1 < x2, y1 < y2)
 	int aux;
@@ -406,812 +1335,4810 @@ void select_image(image_struct *image, int loaded_img_now, char *delim)
 		y2 = aux;
 	}
 
-	// Verify if the coordinates are valid for the image.
-	if (validate_selection(image, x1, y1, x2, y2) == 1) {
-		image->select->x1 = x1;
-		image->select->x2 = x2;
-		image->select->y1 = y1;
-		image->select->y2 = y2;
-		printf("Selected %d %d %d %d\n", x1, y1, x2, y2);
+	// Verify if the coordinates are valid for the image.
+	if (validate_selection(image, x1, y1, x2, y2) == 1) {
+		image->select->x1 = x1;
+		image->select->x2 = x2;
+		image->select->y1 = y1;
+		image->select->y2 = y2;
+		printf("Selected %d %d %d %d\n", x1, y1, x2, y2);
+
+	} else {
+		printf("Invalid set of coordinates\n");
+	}
+}
+
+// ===========================
+// WRITE-BEHIND
+// ===========================
+
+// SAVE doesn't wait for the disk: every full output buffer is queued for a
+// thread that writes it ("writer_work"), and SAVE goes on with a new one. At
+// most WRITE_BUFFERS buffers exist, so SAVE waits when the disk is that far
+// behind. EXIT, and a LOAD or SAVE of a file still being written, wait until
+// everything is written. The bytes are counted once they are written, and a
+// file that could not be written is named at the next LOAD, SAVE or EXIT.
+#define WRITE_BUFFERS 16
+
+struct block_struct {
+	int fd;
+	unsigned char *buf;	 // len bytes to write, or NULL to close fd
+	size_t len;
+	dev_t dev;	// the file, to recognize it
+	ino_t ino;
+	char *path;	 // the file, for the messages (when buf is NULL)
+	struct block_struct *next;
+};
+
+typedef struct block_struct block_struct;
+
+struct writer_struct {
+	pthread_t thread;
+	int started;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;	// a block was queued, or the thread must stop
+	pthread_cond_t written;	 // a block was written
+	block_struct *first, *last;	 // the first one is being written
+	void *spare;  // the free buffers, the first bytes of one link the next
+	int nr_buffers;	 // queued, free, or used by an out_struct
+	long long bytes;  // bytes written, not added to "counters" yet
+	int failed_fd;	// the file being written, if a write() failed, or -1
+	block_struct *failed;  // the closes of the files that failed
+	int stop;
+};
+
+typedef struct writer_struct writer_struct;
+
+writer_struct writer;
+
+int write_all(int fd, void *data, size_t len)
+{
+	// Writes len bytes, retrying if write() is interrupted or writes only a
+	// part of them. Returns 0 if it fails.
+	while (len > 0) {
+		ssize_t written = write(fd, data, len);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return 0;
+		data = (char *)data + written;
+		len -= written;
+	}
+	return 1;
+}
+
+void *writer_work(void *unused)
+{
+	// Writes the blocks in the order they were queued. After a failed
+	// write(), the rest of the file is skipped.
+	(void)unused;
+	pthread_mutex_lock(&writer.lock);
+	while (1) {
+		while (!writer.first && !writer.stop)
+			pthread_cond_wait(&writer.queued, &writer.lock);
+		block_struct *block = writer.first;
+		if (!block)
+			break;
+		int failed = writer.failed_fd == block->fd;
+		pthread_mutex_unlock(&writer.lock);
+		int done = 0;
+		if (block->buf && !failed)
+			done = write_all(block->fd, block->buf, block->len);
+		if (!block->buf && close(block->fd) != 0)
+			failed = 1;
+		pthread_mutex_lock(&writer.lock);
+		writer.first = block->next;
+		if (!writer.first)
+			writer.last = NULL;
+		if (block->buf) {
+			if (done)
+				writer.bytes += block->len;
+			else
+				writer.failed_fd = block->fd;
+			*(void **)block->buf = writer.spare;
+			writer.spare = block->buf;
+			free(block);
+		} else if (failed) {
+			writer.failed_fd = -1;
+			block->next = writer.failed;
+			writer.failed = block;
+		} else {
+			free(block->path);
+			free(block);
+		}
+		pthread_cond_broadcast(&writer.written);
+	}
+	pthread_mutex_unlock(&writer.lock);
+	return NULL;
+}
+
+int writer_start(void)
+{
+	// Starts the thread the first time. Returns 0 if it can't be started.
+	if (writer.started)
+		return 1;
+	pthread_mutex_init(&writer.lock, NULL);
+	pthread_cond_init(&writer.queued, NULL);
+	pthread_cond_init(&writer.written, NULL);
+	writer.failed_fd = -1;
+	if (pthread_create(&writer.thread, NULL, writer_work, NULL) != 0) {
+		fprintf(stderr, "pthread_create() failed\n");
+		pthread_mutex_destroy(&writer.lock);
+		pthread_cond_destroy(&writer.queued);
+		pthread_cond_destroy(&writer.written);
+		return 0;
+	}
+	writer.started = 1;
+	return 1;
+}
+
+unsigned char *writer_buffer(void)
+{
+	// A free output buffer. If there are already WRITE_BUFFERS of them, we
+	// wait for the thread to write one. Returns NULL if none can be had.
+	unsigned char *buf = NULL;
+	pthread_mutex_lock(&writer.lock);
+	while (1) {
+		if (writer.spare) {
+			buf = (unsigned char *)writer.spare;
+			writer.spare = *(void **)buf;
+			break;
+		}
+		if (writer.nr_buffers < WRITE_BUFFERS &&
+			(buf = (unsigned char *)malloc(OUT_BUFFER_SIZE))) {
+			writer.nr_buffers++;
+			break;
+		}
+		if (!writer.first)	// nothing will be freed
+			break;
+		pthread_cond_wait(&writer.written, &writer.lock);
+	}
+	pthread_mutex_unlock(&writer.lock);
+	return buf;
+}
+
+void writer_release(unsigned char *buf)
+{
+	// A buffer given back without being written.
+	pthread_mutex_lock(&writer.lock);
+	*(void **)buf = writer.spare;
+	writer.spare = buf;
+	pthread_mutex_unlock(&writer.lock);
+}
+
+int writer_queue(int fd, struct stat *st, unsigned char *buf, size_t len,
+				 char *path)
+{
+	// Queues len bytes of buf (which the thread keeps), or the close of fd,
+	// the file at path, if buf is NULL. Returns 0 if the block can't be
+	// allocated.
+	block_struct *block = (block_struct *)malloc(sizeof(block_struct));
+	if (!block) {
+		fprintf(stderr, "malloc() for block failed\n");
+		return 0;
+	}
+	block->path = NULL;
+	if (!buf && !(block->path = strdup(path))) {
+		fprintf(stderr, "strdup() for block failed\n");
+		free(block);
+		return 0;
+	}
+	block->fd = fd;
+	block->buf = buf;
+	block->len = len;
+	block->dev = st->st_dev;
+	block->ino = st->st_ino;
+	block->next = NULL;
+	pthread_mutex_lock(&writer.lock);
+	if (writer.last)
+		writer.last->next = block;
+	else
+		writer.first = block;
+	writer.last = block;
+	pthread_cond_signal(&writer.queued);
+	pthread_mutex_unlock(&writer.lock);
+	return 1;
+}
+
+void writer_collect(void)
+{
+	// Adds the bytes written by the thread to "counters".
+	if (!writer.started)
+		return;
+	pthread_mutex_lock(&writer.lock);
+	counters.written += writer.bytes;
+	writer.bytes = 0;
+	pthread_mutex_unlock(&writer.lock);
+}
+
+void writer_report(void)
+{
+	// Names the files that could not be written since the last time.
+	if (!writer.started)
+		return;
+	writer_collect();
+	pthread_mutex_lock(&writer.lock);
+	block_struct *failed = writer.failed;
+	writer.failed = NULL;
+	pthread_mutex_unlock(&writer.lock);
+	while (failed) {
+		block_struct *next = failed->next;
+		printf("Failed to save %s\n", failed->path);
+		free(failed->path);
+		free(failed);
+		failed = next;
+	}
+}
+
+void writer_wait(void)
+{
+	// The barrier: returns when everything queued is written and closed.
+	if (!writer.started)
+		return;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&writer.lock);
+	int waited = writer.first != NULL;
+	while (writer.first)
+		pthread_cond_wait(&writer.written, &writer.lock);
+	pthread_mutex_unlock(&writer.lock);
+	if (options.verbose && waited) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fprintf(stderr, "Waited %.3f s for the writes\n",
+				(end.tv_sec - start.tv_sec) +
+				(end.tv_nsec - start.tv_nsec) / 1e9);
+	}
+	writer_report();
+}
+
+int writer_has_file(char *file_path)
+{
+	// Returns 1 if a part of the file is still to be written.
+	struct stat st;
+	if (!writer.started || !file_path || stat(file_path, &st) != 0)
+		return 0;
+	int found = 0;
+	pthread_mutex_lock(&writer.lock);
+	for (block_struct *block = writer.first; block && !found;
+		 block = block->next)
+		found = block->dev == st.st_dev && block->ino == st.st_ino;
+	pthread_mutex_unlock(&writer.lock);
+	return found;
+}
+
+void writer_stop(void)
+{
+	// Waits for the writes, ends the thread and frees the buffers.
+	if (!writer.started)
+		return;
+	writer_wait();
+	pthread_mutex_lock(&writer.lock);
+	writer.stop = 1;
+	pthread_cond_signal(&writer.queued);
+	pthread_mutex_unlock(&writer.lock);
+	pthread_join(writer.thread, NULL);
+	while (writer.spare) {
+		void *buf = writer.spare;
+		writer.spare = *(void **)buf;
+		free(buf);
+	}
+	pthread_mutex_destroy(&writer.lock);
+	pthread_cond_destroy(&writer.queued);
+	pthread_cond_destroy(&writer.written);
+	memset(&writer, 0, sizeof(writer));
+}
+
+struct out_struct {
+	int fd;
+	unsigned char *buf;	 // OUT_BUFFER_SIZE bytes waiting to be written
+	size_t pos;
+	int failed;
+	int behind;	 // the full buffers are written by the writer thread
+	struct stat st;	 // the file, for the writer thread
+	char *path;
+};
+
+typedef struct out_struct out_struct;
+
+// The decimal digits of every number from 00 to 99, used to write two digits
+// at a time.
+const char digit_pairs[201] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+int out_open(out_struct *out, char *file_path)
+{
+	// What is still to be written in the file must be, before it is emptied.
+	if (writer_has_file(file_path))
+		writer_wait();
+	writer_report();
+	out->path = file_path;
+	out->fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out->fd < 0)
+		return 0;
+	out->behind = options.write_behind &&
+				  fstat(out->fd, &out->st) == 0 && writer_start();
+	if (out->behind)
+		out->buf = writer_buffer();
+	else
+		out->buf = (unsigned char *)malloc(OUT_BUFFER_SIZE);
+	if (!out->buf) {
+		fprintf(stderr, "malloc() for output buffer failed\n");
+		close(out->fd);
+		return 0;
+	}
+	out->pos = 0;
+	out->failed = 0;
+	return 1;
+}
+
+void out_write(out_struct *out, unsigned char *data, size_t len)
+{
+	// Writes len bytes straight to the file.
+	if (len == 0 || out->failed)
+		return;
+	if (write_all(out->fd, data, len) == 0) {
+		out->failed = 1;
+		return;
+	}
+	counters.written += len;
+}
+
+void out_behind_failed(out_struct *out)
+{
+	// After writer_wait: if the thread failed to write a part of the file,
+	// the file failed.
+	pthread_mutex_lock(&writer.lock);
+	if (writer.failed_fd == out->fd) {
+		writer.failed_fd = -1;
+		out->failed = 1;
+	}
+	pthread_mutex_unlock(&writer.lock);
+}
+
+void out_flush(out_struct *out)
+{
+	// With write-behind, the full buffer is queued and we go on with a new
+	// one. If that fails, we wait for the writes and write it ourselves.
+	if (out->behind && out->pos > 0) {
+		unsigned char *buf = writer_buffer();
+		if (buf &&
+			writer_queue(out->fd, &out->st, out->buf, out->pos, NULL)) {
+			out->buf = buf;
+			out->pos = 0;
+			return;
+		}
+		if (buf)
+			writer_release(buf);
+		writer_wait();
+		out_behind_failed(out);
+	}
+	out_write(out, out->buf, out->pos);
+	out->pos = 0;
+}
+
+void out_bytes(out_struct *out, unsigned char *data, size_t len)
+{
+	// Large blocks skip the buffer, small ones are gathered in it. The
+	// writer thread only writes buffers, since data may change as soon as
+	// SAVE returns, so with write-behind everything is copied in them.
+	if (len >= OUT_BUFFER_SIZE / 2 && !out->behind) {
+		out_flush(out);
+		out_write(out, data, len);
+		return;
+	}
+	while (len > 0) {
+		if (out->pos == OUT_BUFFER_SIZE)
+			out_flush(out);
+		size_t n = OUT_BUFFER_SIZE - out->pos;
+		n = len < n ? len : n;
+		memcpy(out->buf + out->pos, data, n);
+		out->pos += n;
+		data += n;
+		len -= n;
+	}
+}
+
+void out_uint(out_struct *out, unsigned int value, char separator)
+{
+	// Writes the decimal digits of value followed by the separator. The
+	// digits are produced from right to left, two at a time.
+	if (OUT_BUFFER_SIZE - out->pos < 12)
+		out_flush(out);
+	char digits[10];
+	int len = 0;
+	while (value >= 100) {
+		unsigned int pair = (value % 100) * 2;
+		value /= 100;
+		digits[9 - len++] = digit_pairs[pair + 1];
+		digits[9 - len++] = digit_pairs[pair];
+	}
+	if (value >= 10) {
+		digits[9 - len++] = digit_pairs[value * 2 + 1];
+		digits[9 - len++] = digit_pairs[value * 2];
+	} else {
+		digits[9 - len++] = '0' + value;
+	}
+
+	unsigned char *dst = out->buf + out->pos;
+	memcpy(dst, digits + 10 - len, len);
+	dst[len] = separator;
+	out->pos += len + 1;
+}
+
+void out_header(out_struct *out, char *image_type, image_struct *image)
+{
+	// The image type, width, height and max_value are written as ASCII.
+	out_bytes(out, (unsigned char *)image_type, 2);
+	out_bytes(out, (unsigned char *)"\n", 1);
+	out_uint(out, image->width, ' ');
+	out_uint(out, image->height, '\n');
+	out_uint(out, image->max_value, '\n');
+}
+
+int out_close(out_struct *out)
+{
+	// With write-behind, the file is closed by the writer thread, and what
+	// fails is reported later (writer_report). Returns 0 if it failed.
+	out_flush(out);
+	if (out->behind) {
+		writer_release(out->buf);
+		if (writer_queue(out->fd, &out->st, NULL, 0, out->path))
+			return 1;
+		writer_wait();
+		out_behind_failed(out);
+		out->behind = 0;
+	} else {
+		free(out->buf);
+	}
+	if (close(out->fd) != 0)
+		out->failed = 1;
+	return !out->failed;
+}
+
+void out_text_rows(out_struct *out, image_struct *image, int i1, int i2)
+{
+	// Writes the rows i1 to i2 - 1 of the image as text. Every sample is
+	// followed by a space, except the last one on a line, which is followed
+	// by a "\n".
+	size_t row_samples = (size_t)image->width * image->channels;
+	for (int i = i1; i < i2; i++) {
+		if (image->depth == 1) {
+			unsigned char *row = row_ptr(image, i);
+			for (size_t k = 0; k < row_samples - 1; k++)
+				out_uint(out, row[k], ' ');
+			out_uint(out, row[row_samples - 1], '\n');
+		} else {
+			uint16_t *row = (uint16_t *)row_ptr(image, i);
+			for (size_t k = 0; k < row_samples - 1; k++)
+				out_uint(out, row[k], ' ');
+			out_uint(out, row[row_samples - 1], '\n');
+		}
+	}
+}
+
+void out_binary_rows(out_struct *out, image_struct *image, int i1, int i2)
+{
+	// Writes the rows i1 to i2 - 1 of the image as binary samples. They are
+	// already kept in the order they are written (grayscale or r, g, b). If
+	// the rows follow each other in memory, they are written at once.
+	size_t row_samples = (size_t)image->width * image->channels;
+	if (image->depth == 1) {
+		if (image->stride == row_samples)
+			out_bytes(out, row_ptr(image, i1), image->stride * (i2 - i1));
+		else
+			for (int i = i1; i < i2; i++)
+				out_bytes(out, row_ptr(image, i), row_samples);
+		return;
+	}
+
+	// Every sample takes 2 bytes, the most significant one first, so we swap
+	// them directly into the output buffer, as many samples at once as there
+	// is room for.
+	for (int i = i1; i < i2; i++) {
+		uint16_t *row = (uint16_t *)row_ptr(image, i);
+		size_t j = 0;
+		while (j < row_samples) {
+			size_t room = (OUT_BUFFER_SIZE - out->pos) / 2;
+			if (room == 0) {
+				out_flush(out);
+				continue;
+			}
+			size_t n = row_samples - j < room ? row_samples - j : room;
+			unsigned char *dst = out->buf + out->pos;
+			for (size_t k = 0; k < n; k++) {
+				dst[2 * k] = (unsigned char)(row[j + k] >> 8);
+				dst[2 * k + 1] = (unsigned char)row[j + k];
+			}
+			out->pos += 2 * n;
+			j += n;
+		}
+	}
+}
+
+// The state of the QOI encoder, kept from one band of rows to the next.
+struct qoi_struct {
+	unsigned char index[64][4];	 // the pixels seen last, by their hash
+	unsigned char prev[4];	// the last pixel, r, g, b and a
+	int run;  // how many times prev was repeated and not written yet
+};
+
+typedef struct qoi_struct qoi_struct;
+
+void out_qoi_header(out_struct *out, qoi_struct *qoi, image_struct *image)
+{
+	// The magic bytes, the width and height as 4 bytes each, the most
+	// significant one first, 3 channels (r, g, b) and the sRGB colorspace.
+	unsigned char header[QOI_HEADER_SIZE] = {'q', 'o', 'i', 'f'};
+	unsigned int size[2] = {image->width, image->height};
+	for (int k = 0; k < 8; k++)
+		header[4 + k] = (unsigned char)(size[k / 4] >> (24 - 8 * (k % 4)));
+	header[12] = 3;
+	header[13] = 0;
+	out_bytes(out, header, QOI_HEADER_SIZE);
+	memset(qoi, 0, sizeof(qoi_struct));
+	qoi->prev[3] = 255;
+}
+
+unsigned char *qoi_chunk(unsigned char *dst, qoi_struct *qoi,
+						 unsigned char r, unsigned char g, unsigned char b)
+{
+	// Writes the chunk of a pixel that differs from the previous one: its
+	// place in the index if it is there, else the smallest difference from
+	// the previous pixel that fits, else the pixel itself.
+	unsigned char *prev = qoi->prev;
+	int hash = QOI_HASH(r, g, b, 255);
+	signed char dr = (signed char)(r - prev[0]);
+	signed char dg = (signed char)(g - prev[1]);
+	signed char db = (signed char)(b - prev[2]);
+	signed char dr_dg = (signed char)(dr - dg), db_dg = (signed char)(db - dg);
+	prev[0] = r;
+	prev[1] = g;
+	prev[2] = b;
+	if (memcmp(qoi->index[hash], prev, 4) == 0) {
+		*dst++ = QOI_OP_INDEX | hash;
+		return dst;
+	}
+	memcpy(qoi->index[hash], prev, 4);
+
+	if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+		*dst++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+	} else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+			   db_dg >= -8 && db_dg <= 7) {
+		*dst++ = QOI_OP_LUMA | (dg + 32);
+		*dst++ = (dr_dg + 8) << 4 | (db_dg + 8);
+	} else {
+		*dst++ = QOI_OP_RGB;
+		*dst++ = r;
+		*dst++ = g;
+		*dst++ = b;
+	}
+	return dst;
+}
+
+void out_qoi_rows(out_struct *out, qoi_struct *qoi, image_struct *image,
+				  int i1, int i2)
+{
+	// Encodes the rows i1 to i2 - 1 of an image with 8-bit samples. The
+	// sample of a grayscale pixel is repeated as r, g and b. A pixel takes 4
+	// bytes at most, plus 1 for the run that it ends, so we make room for as
+	// many pixels at once as there is room for.
+	unsigned char *prev = qoi->prev;
+	int channels = image->channels, run = qoi->run;
+	for (int i = i1; i < i2; i++) {
+		unsigned char *row = row_ptr(image, i);
+		int j = 0;
+		while (j < image->width) {
+			size_t room = (OUT_BUFFER_SIZE - out->pos) / 5;
+			if (room == 0) {
+				out_flush(out);
+				continue;
+			}
+			int end = image->width;
+			if ((size_t)(end - j) > room)
+				end = j + (int)room;
+			unsigned char *dst = out->buf + out->pos;
+			for (; j < end; j++) {
+				unsigned char *src = row + (size_t)j * channels;
+				unsigned char r = src[0];
+				unsigned char g = channels == 1 ? r : src[1];
+				unsigned char b = channels == 1 ? r : src[2];
+				if (r == prev[0] && g == prev[1] && b == prev[2]) {
+					if (++run == 62) {
+						*dst++ = QOI_OP_RUN | (run - 1);
+						run = 0;
+					}
+					continue;
+				}
+				if (run > 0) {
+					*dst++ = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
+				dst = qoi_chunk(dst, qoi, r, g, b);
+			}
+			out->pos = dst - out->buf;
+		}
+	}
+	qoi->run = run;
+}
+
+void out_qoi_end(out_struct *out, qoi_struct *qoi, image_struct *image)
+{
+	// Writes the last run, the end marker and our trailer: the type of the
+	// image (P5 or P6) and its max_value, which a QOI file cannot hold.
+	unsigned char run = QOI_OP_RUN | (qoi->run - 1);
+	if (qoi->run > 0)
+		out_bytes(out, &run, 1);
+	qoi->run = 0;
+	unsigned char trailer[4] = {'P', image->channels == 1 ? '5' : '6',
+								(unsigned char)(image->max_value >> 8),
+								(unsigned char)image->max_value};
+	out_bytes(out, (unsigned char *)qoi_end, 8);
+	out_bytes(out, trailer, 4);
+}
+
+int out_start(out_struct *out, image_struct *image, char *file_path,
+			  int format, qoi_struct *qoi)
+{
+	// Opens the file and writes the header of the format given after SAVE:
+	// P5 or P6 (0), P2 or P3 (1, "ascii") or QOI (3, "qoi").
+	if (format == 3 && image->depth != 1) {
+		printf("Cannot save a 16-bit image as qoi\n");
+		return 0;
+	}
+	if (out_open(out, file_path) == 0) {
+		printf("Cannot open %s\n", file_path);
+		return 0;
+	}
+	if (format == 3)
+		out_qoi_header(out, qoi, image);
+	else if (format == 1)
+		out_header(out, image->channels == 1 ? "P2" : "P3", image);
+	else
+		out_header(out, image->channels == 1 ? "P5" : "P6", image);
+	return 1;
+}
+
+void save_text(image_struct *image, char *file_path)
+{
+	// This function saves the image in a text file.
+	out_struct out;
+	if (out_start(&out, image, file_path, 1, NULL) == 0)
+		return;
+	out_text_rows(&out, image, 0, image->height);
+	if (out_close(&out))
+		printf("Saved %s\n", file_path);
+	else
+		printf("Failed to save %s\n", file_path);
+}
+
+void save_binary(image_struct *image, char *file_path)
+{
+	// This function saves the image in a binary file.
+	out_struct out;
+	if (out_start(&out, image, file_path, 0, NULL) == 0)
+		return;
+	out_binary_rows(&out, image, 0, image->height);
+	if (out_close(&out))
+		printf("Saved %s\n", file_path);
+	else
+		printf("Failed to save %s\n", file_path);
+}
+
+void save_qoi(image_struct *image, char *file_path)
+{
+	// This function saves the image in a QOI file.
+	out_struct out;
+	qoi_struct qoi;
+	if (out_start(&out, image, file_path, 3, &qoi) == 0)
+		return;
+	out_qoi_rows(&out, &qoi, image, 0, image->height);
+	out_qoi_end(&out, &qoi, image);
+	if (out_close(&out))
+		printf("Saved %s\n", file_path);
+	else
+		printf("Failed to save %s\n", file_path);
+}
+
+char *save_target(image_struct *image, int loaded_img_now,
+				  instr_struct *instr, char *out_path)
+{
+	// File_path is the word after SAVE, or out_path when there is none
+	// (--batch). Returns NULL if nothing can be saved.
+	char *file_path = instr->path ? instr->path : out_path;
+
+	if (loaded_img_now == 0) {
+		printf("No image loaded\n");
+		return NULL;
+	}
+	if (!file_path) {
+		printf("Invalid command\n");
+		return NULL;
+	}
+
+	// If the pixels still come from the very file we overwrite, we need our
+	// own copy of them first.
+	struct stat st;
+	mapping_struct *mapping = image->buffer->mapping;
+	if (mapping && stat(file_path, &st) == 0 &&
+		st.st_dev == mapping->dev && st.st_ino == mapping->ino &&
+		own_data(image) == 0) {
+		printf("Failed to save %s\n", file_path);
+		return NULL;
+	}
+	return file_path;
+}
+
+void save(image_struct *image, int loaded_img_now, instr_struct *instr,
+		  char *out_path)
+{
+	char *file_path = save_target(image, loaded_img_now, instr, out_path);
+	if (!file_path)
+		return;
+
+	// We determine the type of saving whether there is a next word after the
+	// file path. If there is not, we save as binary. If there is, and that word
+	// is "ascii", we save as text, and if it is "qoi", as QOI (any other word
+	// saves nothing).
+	if (instr->flag != 2)
+		counters.pixels += (long long)image->width * image->height;
+	if (instr->flag == 0)
+		save_binary(image, file_path);
+	else if (instr->flag == 1)
+		save_text(image, file_path);
+	else if (instr->flag == 3)
+		save_qoi(image, file_path);
+}
+
+//=======================
+// EDITING FUNCTIONS
+//=======================
+
+struct count_job_struct {
+	image_struct *image;
+	select_struct *region;	// the pixels we count
+	int nr_bands;
+	int nr_counts;	// counters of a band: 4 * 256 or 65536
+	unsigned int *counts;  // nr_bands * nr_counts, every band has its own
+};
+
+typedef struct count_job_struct count_job_struct;
+
+void count_band(void *arg, int index)
+{
+	// Counts the values of the grayscale samples in a band of lines of the
+	// region, in counters that only this band uses.
+	count_job_struct *job = (count_job_struct *)arg;
+	image_struct *image = job->image;
+	select_struct *region = job->region;
+	int rows = region->y2 - region->y1;
+	int i_start = region->y1 + (int)((long long)rows * index / job->nr_bands);
+	int i_end =
+		region->y1 + (int)((long long)rows * (index + 1) / job->nr_bands);
+	int x1 = region->x1, x2 = region->x2;
+	unsigned int *counts = job->counts + (size_t)index * job->nr_counts;
+	memset(counts, 0, job->nr_counts * sizeof(unsigned int));
+
+	if (image->depth == 2) {
+		for (int i = i_start; i < i_end; i++) {
+			uint16_t *row = (uint16_t *)row_ptr(image, i);
+			for (int j = x1; j < x2; j++)
+				counts[row[j]]++;
+		}
+		return;
+	}
+
+	// Neighbouring pixels often have the same value. With a single array,
+	// every increment would wait for the previous one to be stored, so we
+	// spread the pixels over 4 arrays and add them up at the end.
+	unsigned int *c0 = counts, *c1 = counts + 256;
+	unsigned int *c2 = counts + 512, *c3 = counts + 768;
+	for (int i = i_start; i < i_end; i++) {
+		unsigned char *row = row_ptr(image, i);
+		int j = x1;
+		for (; j + 4 <= x2; j += 4) {
+			c0[row[j]]++;
+			c1[row[j + 1]]++;
+			c2[row[j + 2]]++;
+			c3[row[j + 3]]++;
+		}
+		for (; j < x2; j++)
+			c0[row[j]]++;
+	}
+}
+
+int count_values(image_struct *image, select_struct *region, long long *freq)
+{
+	// freq[v] becomes the number of grayscale pixels of the region with the
+	// value v, for v from 0 to max_value. The lines are split in bands
+	// between the threads, with no lock: every band counts on its own and
+	// the counters are added up at the end. A (malformed) sample greater
+	// than max_value is counted as max_value.
+	count_job_struct job;
+	int rows = region->y2 - region->y1;
+	job.image = image;
+	job.region = region;
+	job.nr_bands = pool.nr_workers + 1;
+	if (job.nr_bands > rows)
+		job.nr_bands = rows > 0 ? rows : 1;
+	job.nr_counts = image->depth == 1 ? 4 * 256 : 65536;
+	job.counts = (unsigned int *)malloc((size_t)job.nr_bands * job.nr_counts *
+										sizeof(unsigned int));
+	if (!job.counts) {
+		fprintf(stderr, "malloc() for counts failed\n");
+		return 0;
+	}
+	pool_run(count_band, &job, job.nr_bands);
+	counters.pixels += (long long)rows * (region->x2 - region->x1);
+
+	int nr_values = image->depth == 1 ? 256 : 65536;
+	for (int v = 0; v <= image->max_value; v++)
+		freq[v] = 0;
+	for (int k = 0; k < job.nr_bands; k++) {
+		unsigned int *counts = job.counts + (size_t)k * job.nr_counts;
+		for (int c = 0; c < job.nr_counts; c++) {
+			int v = c % nr_values;
+			freq[v <= image->max_value ? v : image->max_value] += counts[c];
+		}
+	}
+	free(job.counts);
+	return 1;
+}
+
+int histogram_bins(image_struct *image, select_struct *region, int bins_nr,
+				   long long *array_freq_bins)
+{
+	// Counts how many pixels of the region fall in every one of the bins_nr
+	// bins.
+	long long *freq =
+		(long long *)malloc((image->max_value + 1) * sizeof(long long));
+	if (!freq) {
+		fprintf(stderr, "malloc() for array failed\n");
+		return 0;
+	}
+	if (count_values(image, region, freq) == 0) {
+		free(freq);
+		return 0;
+	}
+
+	// We determine how many pixel values are included in an interval of numbers
+	// that create a bin. We need to store it as a double to keep in mind if the
+	// total number of values is not divisible by the number of bins.
+	double interval = (double)(image->max_value + 1) / bins_nr;
+
+	for (int i = 0; i < bins_nr; i++)
+		array_freq_bins[i] = 0;
+	for (int v = 0; v <= image->max_value; v++) {
+		// We determine in which bin is the value found by dividing to the
+		// interval and approximating the value to the closest lower
+		// integer. We will have a result of {0, 1, 2,..., bins_nr - 1}. This
+		// is done once for every value, not for every pixel.
+		int pos_bin = floor((double)v / interval);
+		array_freq_bins[pos_bin] += freq[v];
+	}
+	free(freq);
+	return 1;
+}
+
+void histogram(image_struct *image, int loaded_img_now, instr_struct *instr)
+{
+	if (loaded_img_now == 0) {
+		printf("No image loaded\n");
+		return;
+	}
+	if (instr->invalid) {
+		printf("Invalid command\n");
+		return;
+	}
+	int max_stars = instr->args[0];
+	int bins_nr = instr->args[1];
+
+	// With SELECTION, we only count the pixels of the selection.
+	select_struct whole = {0, image->width, 0, image->height};
+	select_struct *region = instr->flag ? image->select : &whole;
+
+	if (strcmp(image->image_type, "P3") == 0 ||
+		strcmp(image->image_type, "P6") == 0) {
+		printf("Black and white image needed\n");
+		return;
+	}
+
+	long long *array_freq_bins =
+		(long long *)malloc(bins_nr * sizeof(long long));
+	if (!array_freq_bins) {
+		fprintf(stderr, "malloc() for array failed\n");
+		return;
+	}
+	if (histogram_bins(image, region, bins_nr, array_freq_bins) == 0) {
+		free(array_freq_bins);
+		return;
+	}
+
+	// Determine the maximum value in the frequency array.
+	long long max_freq = 0;
+	for (int i = 0; i < bins_nr; i++)
+		if (array_freq_bins[i] > max_freq)
+			max_freq = array_freq_bins[i];
+
+	// For each bin, we determine the number of stars and print the result
+	// accordingly.
+	for (int i = 0; i < bins_nr; i++) {
+		int nr_stars = (int)(array_freq_bins[i] * max_stars / max_freq);
+		printf("%d\t|\t", nr_stars);
+		for (int j = 0; j < nr_stars; j++)
+			printf("*");
+		printf("\n");
+	}
+
+	free(array_freq_bins);
+}
+
+double clamp(double nr, int min, int max)
+{
+	// Make sure "nr" doesn't exceed the limits "min" or "max".
+	if (nr < min)
+		return min;
+	if (nr > max)
+		return max;
+	return nr;
+}
+
+struct remap_job_struct {
+	image_struct *image;
+	select_struct *region;	// the pixels we change
+	int nr_bands;
+	void *lut;	// the new value of every possible sample (uint8_t / uint16_t)
+};
+
+typedef struct remap_job_struct remap_job_struct;
+
+void remap_band(void *arg, int index)
+{
+	// Replaces every grayscale sample of a band of lines of the region with
+	// its value from the lookup table.
+	remap_job_struct *job = (remap_job_struct *)arg;
+	image_struct *image = job->image;
+	select_struct *region = job->region;
+	int rows = region->y2 - region->y1;
+	int i_start = region->y1 + (int)((long long)rows * index / job->nr_bands);
+	int i_end =
+		region->y1 + (int)((long long)rows * (index + 1) / job->nr_bands);
+
+	int x1 = region->x1, x2 = region->x2;
+	if (image->depth == 1) {
+		uint8_t *lut = (uint8_t *)job->lut;
+		for (int i = i_start; i < i_end; i++) {
+			uint8_t *row = row_ptr(image, i);
+			for (int j = x1; j < x2; j++)
+				row[j] = lut[row[j]];
+		}
+	} else {
+		uint16_t *lut = (uint16_t *)job->lut;
+		for (int i = i_start; i < i_end; i++) {
+			uint16_t *row = (uint16_t *)row_ptr(image, i);
+			for (int j = x1; j < x2; j++)
+				row[j] = lut[row[j]];
+		}
+	}
+}
+
+void *equalize_lut(image_struct *image, select_struct *region)
+{
+	// Returns the new value of every possible sample of the region, using
+	// only the frequencies of its own pixels, or NULL without memory.
+	int nr_values = image->depth == 1 ? 256 : 65536;
+	long long area = (long long)(region->y2 - region->y1) *
+					 (region->x2 - region->x1);
+
+	// We determine how many pixels of the same value exist with a frequency
+	// array.
+	long long *freq =
+		(long long *)malloc((image->max_value + 1) * sizeof(long long));
+	void *lut = malloc(nr_values * image->depth);
+	if (!freq || !lut) {
+		fprintf(stderr, "malloc() for array failed\n");
+		free(freq);
+		free(lut);
+		return NULL;
+	}
+	if (count_values(image, region, freq) == 0) {
+		free(freq);
+		free(lut);
+		return NULL;
+	}
+
+	// For each value of a pixel, the sum of appearances of pixels with values
+	// lower or equal with it is the sum for the previous value plus its own
+	// frequency, so a single pass is enough. We calculate the new value of the
+	// pixel with the formula provided in the documentation.
+	long long partial_sum_freq = 0;
+	for (int v = 0; v < nr_values; v++) {
+		int new_value;
+		if (v <= image->max_value) {
+			partial_sum_freq += freq[v];
+			double new_val = (double)image->max_value *
+							 (double)partial_sum_freq / (double)area;
+			new_value = round(clamp(new_val, 0, image->max_value));
+		} else {  // a (malformed) sample greater than max_value
+			new_value = image->max_value;
+		}
+		if (image->depth == 1)
+			((uint8_t *)lut)[v] = (uint8_t)new_value;
+		else
+			((uint16_t *)lut)[v] = (uint16_t)new_value;
+	}
+	free(freq);
+	return lut;
+}
+
+void remap_region(image_struct *image, select_struct *region, void *lut)
+{
+	// We replace the old values with the new ones. The pixels must be the
+	// image's own (unshare_data).
+	remap_job_struct job;
+	job.image = image;
+	job.region = region;
+	job.nr_bands = pool_bands(region->y2 - region->y1, 16);
+	job.lut = lut;
+	pool_run(remap_band, &job, job.nr_bands);
+}
+
+int border_kernel_min(int number)
+{
+	// Determines the starting coordinate from which the kernel should be
+	// applied.
+	// Because we have a 3x3 matrix to apply on the image, we need a value
+	// greater than 0.
+	if (number > 0)
+		return number;
+	else
+		return 1;
+}
+
+int border_kernel_max(int max_selected, int max_img)
+{
+	// Determines the ending coordinate until which the kernel should be
+	// applied.
+	// Because we have a 3x3 matrix to apply on the image, we need a value
+	// lower than the height or width of the image.
+	if (max_selected < max_img)
+		return max_selected;
+	else
+		return (max_selected - 1);
+}
+
+// ===========================
+// CONVOLUTION
+// ===========================
+
+struct kernel_struct {
+	int coef[3][3];	 // the kernel multiplied by divisor
+	int divisor;
+	int bias;	// divisor / 2, so the division rounds to the closest integer
+	int magic;	// (x * magic) >> 16 == x / divisor for the sums of 8-bit pixels
+	int simd;	// the sums of 8-bit pixels fit in 16 bits and magic is exact
+	int simd16;	 // the sums of 16-bit pixels are exact as floats
+};
+
+typedef struct kernel_struct kernel_struct;
+
+struct named_kernel_struct {
+	char *name;
+	double mat[3][3];
+};
+
+typedef struct named_kernel_struct named_kernel_struct;
+
+const named_kernel_struct named_kernels[] = {
+	{"EDGE", {{-1, -1, -1}, {-1, 8, -1}, {-1, -1, -1}}},
+	{"SHARPEN", {{0, -1, 0}, {-1, 5, -1}, {0, -1, 0}}},
+	{"BLUR",
+	 {{1.0 / 9, 1.0 / 9, 1.0 / 9},
+	  {1.0 / 9, 1.0 / 9, 1.0 / 9},
+	  {1.0 / 9, 1.0 / 9, 1.0 / 9}}},
+	{"GAUSSIAN_BLUR",
+	 {{1.0 / 16, 2.0 / 16, 1.0 / 16},
+	  {2.0 / 16, 4.0 / 16, 2.0 / 16},
+	  {1.0 / 16, 2.0 / 16, 1.0 / 16}}},
+};
+
+#define NR_NAMED_KERNELS 4
+#define NMAX_STAGES 16	// kernels applied by a single APPLY
+#define NMAX_PENDING 64	 // APPLY commands kept before they are done
+#define STREAM_ROWS 256	 // rows of the bands of a streamed SAVE, at least
+#define ROTATE_TILE 64	// pixels on the side of a block rotated at once
+#define NMAX_KERNEL_SIZE 15	 // for APPLY CUSTOM
+#define NMAX_RADIUS 1000	 // for APPLY BOX_BLUR and APPLY GAUSSIAN
+
+// How the result of a large kernel is computed.
+#define BIG_DOUBLE 0	 // the coefficients are not integers
+#define BIG_DIRECT 1	 // all the size * size products for every sample
+#define BIG_SEPARABLE 2	 // a horizontal pass, then a vertical one
+#define BIG_BOX 3		 // equal coefficients: sums of a sliding window
+
+int make_kernel(const double mat[][3], kernel_struct *kernel)
+{
+	// Turns the kernel into integer coefficients and a common divisor, if
+	// that gives exactly the same results as rounding the double sums:
+	// round(sum / divisor) never hits a tie for an odd divisor, and for a
+	// power of two the double sums are exact.
+	int divisor;
+	for (divisor = 1; divisor <= 256; divisor++) {
+		int whole = 1;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++) {
+				double coef = mat[i][j] * divisor;
+				if (fabs(coef - round(coef)) > 1e-9 || fabs(coef) > 4096)
+					whole = 0;
+			}
+		if (whole)
+			break;
+	}
+	if (divisor > 256 || (divisor % 2 == 0 && (divisor & (divisor - 1))))
+		return 0;
+
+	int pos = 0, neg = 0;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++) {
+			kernel->coef[i][j] = (int)round(mat[i][j] * divisor);
+			if (kernel->coef[i][j] > 0)
+				pos += kernel->coef[i][j];
+			else
+				neg -= kernel->coef[i][j];
+		}
+	kernel->divisor = divisor;
+	kernel->bias = divisor / 2;
+	kernel->magic = (65536 + divisor - 1) / divisor;
+
+	// The vectorized code keeps the sums of 8-bit pixels in 16 bits.
+	int max_sum = pos * 255 + kernel->bias;
+	kernel->simd = max_sum <= 32767 && neg * 255 <= 32768;
+	if (divisor > 1)
+		for (int x = 0; x <= max_sum && kernel->simd; x++)
+			if ((x * kernel->magic) >> 16 != x / divisor)
+				kernel->simd = 0;
+
+	// The vectorized code for 16-bit pixels computes with floats, which hold
+	// every integer up to 2^24 exactly. Below that, the quotient of x by the
+	// divisor is never rounded up to the next integer, so truncating it gives
+	// x / divisor.
+	kernel->simd16 = (long long)pos * 65535 + kernel->bias + divisor <=
+						 (1 << 24) &&
+					 (long long)neg * 65535 <= (1 << 24);
+	return 1;
+}
+
+static inline int row_sample(unsigned char *row, int depth, int p)
+{
+	if (depth == 1)
+		return row[p];
+	return ((uint16_t *)row)[p];
+}
+
+static inline void store_sample(unsigned char *row, int depth, int p,
+								int value)
+{
+	if (depth == 1)
+		row[p] = (unsigned char)value;
+	else
+		((uint16_t *)row)[p] = (uint16_t)value;
+}
+
+void convolve_row_scalar(kernel_struct *kernel, unsigned char *rows[3],
+						 unsigned char *out, int s0, int s1, int ch,
+						 int depth, int max_value)
+{
+	// Computes the samples s0, ..., s1 - 1 of a line. rows are the line above,
+	// the line itself and the line below. The neighbours of a sample are ch
+	// samples to its left and right.
+	for (int p = s0; p < s1; p++) {
+		int sum = 0;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++)
+				sum += kernel->coef[i][j] *
+					   row_sample(rows[i], depth, p + (j - 1) * ch);
+
+		// A negative sum is clamped to 0, a positive one is rounded to the
+		// closest integer (the ties going up) and clamped to max_value.
+		int value = sum <= 0 ? 0 : (sum + kernel->bias) / kernel->divisor;
+		if (value > max_value)
+			value = max_value;
+		store_sample(out, depth, p, value);
+	}
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("sse2"))) int
+convolve_row_sse2(kernel_struct *kernel, unsigned char *rows[3],
+				  unsigned char *out, int s0, int s1, int ch, int row_len,
+				  int max_value)
+{
+	// 8 samples of 8 bits at a time, with the sums kept in 16 bits. Returns
+	// the first sample that is left for the scalar code.
+	__m128i zero = _mm_setzero_si128();
+	__m128i bias = _mm_set1_epi16(kernel->bias);
+	__m128i magic = _mm_set1_epi16(kernel->magic);
+	__m128i max = _mm_set1_epi16(max_value);
+	__m128i coef[3][3];
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			coef[i][j] = _mm_set1_epi16(kernel->coef[i][j]);
+
+	int p = s0;
+	for (; p + 8 <= s1 && p + ch + 8 <= row_len; p += 8) {
+		__m128i sum = zero;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++) {
+				__m128i x = _mm_loadl_epi64(
+					(__m128i *)(rows[i] + p + (j - 1) * ch));
+				x = _mm_unpacklo_epi8(x, zero);
+				sum = _mm_add_epi16(sum, _mm_mullo_epi16(x, coef[i][j]));
+			}
+		sum = _mm_max_epi16(sum, zero);
+		if (kernel->divisor > 1)
+			sum = _mm_mulhi_epu16(_mm_add_epi16(sum, bias), magic);
+		sum = _mm_min_epi16(sum, max);
+		_mm_storel_epi64((__m128i *)(out + p), _mm_packus_epi16(sum, sum));
+	}
+	return p;
+}
+
+__attribute__((target("avx2"))) int
+convolve_row_avx2(kernel_struct *kernel, unsigned char *rows[3],
+				  unsigned char *out, int s0, int s1, int ch, int row_len,
+				  int max_value)
+{
+	// The same as convolve_row_sse2, 16 samples at a time.
+	__m256i zero = _mm256_setzero_si256();
+	__m256i bias = _mm256_set1_epi16(kernel->bias);
+	__m256i magic = _mm256_set1_epi16(kernel->magic);
+	__m256i max = _mm256_set1_epi16(max_value);
+	__m256i coef[3][3];
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			coef[i][j] = _mm256_set1_epi16(kernel->coef[i][j]);
+
+	int p = s0;
+	for (; p + 16 <= s1 && p + ch + 16 <= row_len; p += 16) {
+		__m256i sum = zero;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++) {
+				__m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+					(__m128i *)(rows[i] + p + (j - 1) * ch)));
+				sum = _mm256_add_epi16(sum,
+									   _mm256_mullo_epi16(x, coef[i][j]));
+			}
+		sum = _mm256_max_epi16(sum, zero);
+		if (kernel->divisor > 1)
+			sum = _mm256_mulhi_epu16(_mm256_add_epi16(sum, bias), magic);
+		sum = _mm256_min_epi16(sum, max);
+		__m128i low = _mm256_castsi256_si128(sum);
+		__m128i high = _mm256_extracti128_si256(sum, 1);
+		_mm_storeu_si128((__m128i *)(out + p), _mm_packus_epi16(low, high));
+	}
+	return p;
+}
+
+__attribute__((target("sse2"))) int
+convolve_row16_sse2(kernel_struct *kernel, unsigned char *rows[3],
+					unsigned char *out, int s0, int s1, int ch, int row_len,
+					int max_value)
+{
+	// 8 samples of 16 bits at a time, with the sums kept in floats.
+	__m128i izero = _mm_setzero_si128();
+	__m128i offset = _mm_set1_epi32(32768);
+	__m128i flip = _mm_set1_epi16((short)0x8000);
+	__m128 zero = _mm_setzero_ps();
+	__m128 bias = _mm_set1_ps((float)kernel->bias);
+	__m128 divisor = _mm_set1_ps((float)kernel->divisor);
+	__m128 max = _mm_set1_ps((float)max_value);
+	__m128 coef[3][3];
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			coef[i][j] = _mm_set1_ps((float)kernel->coef[i][j]);
+
+	int p = s0;
+	for (; p + 8 <= s1 && p + ch + 8 <= row_len; p += 8) {
+		__m128 low = zero, high = zero;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++) {
+				__m128i x = _mm_loadu_si128(
+					(__m128i *)((uint16_t *)rows[i] + p + (j - 1) * ch));
+				__m128 x_low = _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, izero));
+				__m128 x_high = _mm_cvtepi32_ps(_mm_unpackhi_epi16(x, izero));
+				low = _mm_add_ps(low, _mm_mul_ps(x_low, coef[i][j]));
+				high = _mm_add_ps(high, _mm_mul_ps(x_high, coef[i][j]));
+			}
+		low = _mm_max_ps(low, zero);
+		high = _mm_max_ps(high, zero);
+		if (kernel->divisor > 1) {
+			low = _mm_div_ps(_mm_add_ps(low, bias), divisor);
+			high = _mm_div_ps(_mm_add_ps(high, bias), divisor);
+		}
+		low = _mm_min_ps(low, max);
+		high = _mm_min_ps(high, max);
+
+		// SSE2 can only pack to signed 16 bits, so we move the values to
+		// [-32768, 32767] and back.
+		__m128i a = _mm_sub_epi32(_mm_cvttps_epi32(low), offset);
+		__m128i b = _mm_sub_epi32(_mm_cvttps_epi32(high), offset);
+		_mm_storeu_si128((__m128i *)((uint16_t *)out + p),
+						 _mm_xor_si128(_mm_packs_epi32(a, b), flip));
+	}
+	return p;
+}
+
+__attribute__((target("avx2"))) int
+convolve_row16_avx2(kernel_struct *kernel, unsigned char *rows[3],
+					unsigned char *out, int s0, int s1, int ch, int row_len,
+					int max_value)
+{
+	// The same as convolve_row16_sse2, 16 samples at a time.
+	__m256 zero = _mm256_setzero_ps();
+	__m256 bias = _mm256_set1_ps((float)kernel->bias);
+	__m256 divisor = _mm256_set1_ps((float)kernel->divisor);
+	__m256 max = _mm256_set1_ps((float)max_value);
+	__m256 coef[3][3];
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			coef[i][j] = _mm256_set1_ps((float)kernel->coef[i][j]);
+
+	int p = s0;
+	for (; p + 16 <= s1 && p + ch + 16 <= row_len; p += 16) {
+		__m256 low = zero, high = zero;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++) {
+				uint16_t *src = (uint16_t *)rows[i] + p + (j - 1) * ch;
+				__m256 x_low = _mm256_cvtepi32_ps(
+					_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)src)));
+				__m256 x_high = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(
+					_mm_loadu_si128((__m128i *)(src + 8))));
+				low = _mm256_add_ps(low, _mm256_mul_ps(x_low, coef[i][j]));
+				high = _mm256_add_ps(high, _mm256_mul_ps(x_high, coef[i][j]));
+			}
+		low = _mm256_max_ps(low, zero);
+		high = _mm256_max_ps(high, zero);
+		if (kernel->divisor > 1) {
+			low = _mm256_div_ps(_mm256_add_ps(low, bias), divisor);
+			high = _mm256_div_ps(_mm256_add_ps(high, bias), divisor);
+		}
+		low = _mm256_min_ps(low, max);
+		high = _mm256_min_ps(high, max);
+
+		// packus works inside the two halves of the registers, so the 4
+		// groups of 4 results are put back in order.
+		__m256i packed = _mm256_packus_epi32(_mm256_cvttps_epi32(low),
+											 _mm256_cvttps_epi32(high));
+		_mm256_storeu_si256((__m256i *)((uint16_t *)out + p),
+							_mm256_permute4x64_epi64(packed, 0xD8));
+	}
+	return p;
+}
+#endif
+
+int detect_isa(void)
+{
+	// The best instruction set of the processor we are running on.
+#if HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return ISA_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return ISA_SSE2;
+#endif
+	return ISA_SCALAR;
+}
+
+struct stage_struct {
+	const double (*mat)[3];
+	kernel_struct kernel;
+	int fixed;	// the fixed-point kernel is used instead of the double code
+};
+
+typedef struct stage_struct stage_struct;
+
+void make_stage(stage_struct *stage, const double mat[][3], int isa)
+{
+	stage->mat = mat;
+	stage->fixed = isa != ISA_DOUBLE && make_kernel(mat, &stage->kernel);
+}
+
+void convolve_row_double(const double mat[][3], unsigned char *rows[3],
+						 unsigned char *out, int s0, int s1, int ch,
+						 int depth, int max_value)
+{
+	// Because we have a 3x3 matrix and the element we calculate for is in
+	// its center, we go from [i - 1][j - 1] until [i + 1][j + 1].
+	for (int p = s0; p < s1; p++) {
+		double sum = 0.0;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++)
+				sum += (double)mat[i][j] *
+					   row_sample(rows[i], depth, p + (j - 1) * ch);
+		sum = round(sum);
+
+		// We have to make sure the calculated values are not negative or go
+		// beyond the maximum value.
+		store_sample(out, depth, p, clamp(sum, 0, max_value));
+	}
+}
+
+void convolve_row(stage_struct *stage, unsigned char *rows[3],
+				  unsigned char *out, int s0, int s1, int ch, int row_len,
+				  int depth, int max_value, int isa)
+{
+	if (!stage->fixed) {
+		convolve_row_double(stage->mat, rows, out, s0, s1, ch, depth,
+							max_value);
+		return;
+	}
+
+	// The vectorized code does most of the line, the scalar code finishes it.
+	kernel_struct *kernel = &stage->kernel;
+#if HAVE_X86_SIMD
+	if (depth == 1 && kernel->simd) {
+		if (isa == ISA_AVX2)
+			s0 = convolve_row_avx2(kernel, rows, out, s0, s1, ch, row_len,
+								   max_value);
+		if (isa >= ISA_SSE2)
+			s0 = convolve_row_sse2(kernel, rows, out, s0, s1, ch, row_len,
+								   max_value);
+	}
+	if (depth == 2 && kernel->simd16) {
+		if (isa == ISA_AVX2)
+			s0 = convolve_row16_avx2(kernel, rows, out, s0, s1, ch, row_len,
+									 max_value);
+		if (isa >= ISA_SSE2)
+			s0 = convolve_row16_sse2(kernel, rows, out, s0, s1, ch, row_len,
+									 max_value);
+	}
+#else
+	(void)row_len;
+	(void)isa;
+#endif
+	convolve_row_scalar(kernel, rows, out, s0, s1, ch, depth, max_value);
+}
+
+struct convolve_job_struct {
+	image_struct *initial;
+	image_struct *result;
+	stage_struct *stages;
+	int nr_stages;
+	int i_min, i_max, j_min, j_max;
+	int nr_bands;
+	int isa;
+	unsigned char *rings;  // the ring of every band, ring_size bytes each
+	size_t ring_size;
+};
+
+typedef struct convolve_job_struct convolve_job_struct;
+
+unsigned char *stage_row(convolve_job_struct *job, unsigned char *ring, int k,
+						 int r)
+{
+	// Line r as it is after the first k kernels. The lines outside the
+	// selection never change, the others are kept in a ring of 3 lines for
+	// every kernel but the last one.
+	if (k == 0 || r < job->i_min || r >= job->i_max)
+		return row_ptr(job->initial, r);
+	return ring + ((size_t)(k - 1) * 3 + r % 3) * job->initial->stride;
+}
+
+void convolve_band(void *arg, int index)
+{
+	// Computes the lines [i_start, i_end) of the result. Kernel k needs the
+	// lines above and below from kernel k - 1, so at step t it computes line
+	// t - k: a few lines of the previous kernel are all we keep. A band also
+	// computes the lines around it that the last kernel depends on, so the
+	// bands don't depend on each other and can be computed in any order.
+	convolve_job_struct *job = (convolve_job_struct *)arg;
+	image_struct *initial = job->initial;
+	int n = job->nr_stages;
+	int nr_rows = job->i_max - job->i_min;
+	int i_start = job->i_min + (int)((long long)nr_rows * index / job->nr_bands);
+	int i_end =
+		job->i_min + (int)((long long)nr_rows * (index + 1) / job->nr_bands);
+
+	unsigned char *ring = job->rings + job->ring_size * index;
+	int ch = initial->channels;
+	int psize = pixel_size(initial);
+	for (int t = i_start - (n - 1); t < i_end + (n - 1); t++) {
+		for (int k = 1; k <= n; k++) {
+			// The lines kernel k has to compute for this band.
+			int r = t - (k - 1);
+			if (r < i_start - (n - k) || r >= i_end + (n - k) ||
+				r < job->i_min || r >= job->i_max)
+				continue;
+
+			unsigned char *rows[3];
+			for (int d = -1; d <= 1; d++)
+				rows[d + 1] = stage_row(job, ring, k - 1, r + d);
+			unsigned char *out;
+			if (k == n) {
+				out = row_ptr(job->result, r);
+			} else {
+				// The next kernel also reads the pixels just outside the
+				// selection, which never change.
+				out = stage_row(job, ring, k, r);
+				copy_pixel(out + (size_t)(job->j_min - 1) * psize,
+						   pixel_ptr(initial, r, job->j_min - 1), psize);
+				copy_pixel(out + (size_t)job->j_max * psize,
+						   pixel_ptr(initial, r, job->j_max), psize);
+			}
+			convolve_row(&job->stages[k - 1], rows, out, job->j_min * ch,
+						 job->j_max * ch, ch, initial->width * ch,
+						 initial->depth, initial->max_value, job->isa);
+		}
+	}
+}
+
+int convolve(image_struct *initial, image_struct *result,
+			 stage_struct *stages, int nr_stages, int isa)
+{
+	// Applies the kernels one after the other on the selection of initial and
+	// writes the new pixels in result, which starts as a copy of initial. All
+	// of them are done in a single pass over the lines, which are split in
+	// bands shared by the threads of the pool. Returns 0, with result left
+	// as it was, if the rings of the bands can't be allocated.
+	convolve_job_struct job;
+	job.initial = initial;
+	job.result = result;
+	job.stages = stages;
+	job.nr_stages = nr_stages;
+	job.isa = isa;
+
+	// We determine the starting and ending coordinates for the kernel
+	// application.
+	job.i_min = border_kernel_min(initial->select->y1);
+	job.j_min = border_kernel_min(initial->select->x1);
+	job.i_max = border_kernel_max(initial->select->y2, initial->height);
+	job.j_max = border_kernel_max(initial->select->x2, initial->width);
+	if (job.i_max <= job.i_min || job.j_max <= job.j_min)
+		return 1;
+
+	// Every band computes 2 * (nr_stages - 1) lines more than its own.
+	job.nr_bands = pool_bands(job.i_max - job.i_min, 16 * nr_stages);
+	job.ring_size = (size_t)(nr_stages - 1) * 3 * initial->stride;
+	job.rings = NULL;
+	if (nr_stages > 1) {
+		job.rings = (unsigned char *)malloc(job.ring_size * job.nr_bands);
+		if (!job.rings) {
+			fprintf(stderr, "malloc() for rings failed\n");
+			return 0;
+		}
+	}
+	pool_run(convolve_band, &job, job.nr_bands);
+	free(job.rings);
+	return 1;
+}
+
+// ===========================
+// LARGE KERNELS
+// ===========================
+
+struct big_kernel_struct {
+	int size;	   // odd: the kernel covers size x size pixels
+	int type;	   // BIG_*
+	double *mat;   // size * size coefficients, for BIG_DOUBLE
+	long long *coef;  // size * size integer coefficients, for BIG_DIRECT
+	long long *col;	  // for BIG_SEPARABLE, coef[i][j] is proportional to
+	long long *row;	  // col[i] * row[j]
+	long long num;	  // the result is round(integer sum * num / den)
+	long long den;
+};
+
+typedef struct big_kernel_struct big_kernel_struct;
+
+long long gcd_ll(long long a, long long b)
+{
+	if (a < 0)
+		a = -a;
+	if (b < 0)
+		b = -b;
+	while (b) {
+		long long r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+void free_big_kernel(big_kernel_struct *kernel)
+{
+	free(kernel->mat);
+	free(kernel->coef);
+	free(kernel->col);
+	free(kernel->row);
+}
+
+void *copy_array(void *array, size_t size)
+{
+	// NULL stays NULL.
+	if (!array)
+		return NULL;
+	void *copy = malloc(size);
+	if (copy)
+		memcpy(copy, array, size);
+	return copy;
+}
+
+int copy_big_kernel(big_kernel_struct *dst, big_kernel_struct *src)
+{
+	size_t n = (size_t)src->size * src->size;
+	*dst = *src;
+	dst->mat = (double *)copy_array(src->mat, n * sizeof(double));
+	dst->coef = (long long *)copy_array(src->coef, n * sizeof(long long));
+	dst->col = (long long *)copy_array(src->col, src->size * sizeof(long long));
+	dst->row = (long long *)copy_array(src->row, src->size * sizeof(long long));
+	if ((src->mat && !dst->mat) || (src->coef && !dst->coef) ||
+		(src->col && !dst->col) || (src->row && !dst->row)) {
+		fprintf(stderr, "malloc() for kernel failed\n");
+		free_big_kernel(dst);
+		return 0;
+	}
+	return 1;
+}
+
+void big_kernel_init(big_kernel_struct *kernel, int size, int type)
+{
+	kernel->size = size;
+	kernel->type = type;
+	kernel->mat = NULL;
+	kernel->coef = NULL;
+	kernel->col = NULL;
+	kernel->row = NULL;
+	kernel->num = 1;
+	kernel->den = 1;
+}
+
+int big_kernel_fits(double max_sum, long long num)
+{
+	// The sums (multiplied by num) of 16-bit samples must fit in a long long.
+	return max_sum * 65535.0 * (num < 0 ? -num : num) < 1e18;
+}
+
+void big_kernel_ratio(big_kernel_struct *kernel, long long num, long long den)
+{
+	// Keeps num / den as an irreducible fraction with a positive denominator.
+	if (den < 0) {
+		num = -num;
+		den = -den;
+	}
+	long long g = gcd_ll(num, den);
+	if (g > 1) {
+		num /= g;
+		den /= g;
+	}
+	kernel->num = num;
+	kernel->den = den;
+}
+
+int big_kernel_box(big_kernel_struct *kernel, int radius)
+{
+	// BOX_BLUR: the average of the (2 * radius + 1)^2 pixels around.
+	int size = 2 * radius + 1;
+	big_kernel_init(kernel, size, BIG_BOX);
+	big_kernel_ratio(kernel, 1, (long long)size * size);
+	return 1;
+}
+
+int big_kernel_gaussian(big_kernel_struct *kernel, int radius)
+{
+	// GAUSSIAN: a binomial kernel (the row 2 * radius of Pascal's triangle,
+	// scaled so that it adds up to about 65536), separable by definition.
+	int size = 2 * radius + 1;
+	big_kernel_init(kernel, size, BIG_SEPARABLE);
+	kernel->col = (long long *)malloc(size * sizeof(long long));
+	kernel->row = (long long *)malloc(size * sizeof(long long));
+	if (!kernel->col || !kernel->row) {
+		fprintf(stderr, "malloc() for kernel failed\n");
+		free_big_kernel(kernel);
+		return 0;
+	}
+
+	long long total = 0;
+	for (int k = 0; k < size; k++) {
+		double log_binomial = lgamma(size) - lgamma(k + 1) -
+							  lgamma(size - k) - (size - 1) * log(2.0);
+		kernel->col[k] = llround(exp(log_binomial) * 65536);
+		kernel->row[k] = kernel->col[k];
+		total += kernel->col[k];
+	}
+	big_kernel_ratio(kernel, 1, total * total);
+	return 1;
+}
+
+int big_kernel_custom(big_kernel_struct *kernel, double *mat, int size)
+{
+	// CUSTOM: the kernel is given by its size * size coefficients. We find
+	// the smallest divisor that turns all of them into integers and then
+	// look for the fastest way to apply it.
+	big_kernel_init(kernel, size, BIG_DOUBLE);
+	int n2 = size * size;
+	int divisor;
+	for (divisor = 1; divisor <= 1024; divisor++) {
+		int whole = 1;
+		for (int k = 0; k < n2 && whole; k++) {
+			double coef = mat[k] * divisor;
+			if (fabs(coef - round(coef)) > 1e-9 || fabs(coef) > (1 << 20))
+				whole = 0;
+		}
+		if (whole)
+			break;
+	}
+
+	kernel->mat = (double *)malloc(n2 * sizeof(double));
+	if (!kernel->mat) {
+		fprintf(stderr, "malloc() for kernel failed\n");
+		return 0;
+	}
+	memcpy(kernel->mat, mat, n2 * sizeof(double));
+	if (divisor > 1024)
+		return 1;  // the double code
+
+	kernel->coef = (long long *)malloc(n2 * sizeof(long long));
+	if (!kernel->coef) {
+		fprintf(stderr, "malloc() for kernel failed\n");
+		free_big_kernel(kernel);
+		return 0;
+	}
+	double abs_sum = 0;
+	for (int k = 0; k < n2; k++) {
+		kernel->coef[k] = llround(mat[k] * divisor);
+		abs_sum += llabs(kernel->coef[k]);
+	}
+	if (!big_kernel_fits(abs_sum, 1))
+		return 1;
+	kernel->type = BIG_DIRECT;
+	big_kernel_ratio(kernel, 1, divisor);
+	long long *coef = kernel->coef;
+
+	// All the coefficients are equal: a box.
+	int box = 1;
+	for (int k = 1; k < n2; k++)
+		if (coef[k] != coef[0])
+			box = 0;
+	if (box && big_kernel_fits(n2, coef[0])) {
+		kernel->type = BIG_BOX;
+		big_kernel_ratio(kernel, coef[0], divisor);
+		return 1;
+	}
+
+	// coef[i][j] = col[i] * row[j] * g_col * g_row / coef[p][q] for every
+	// i and j if the matrix has rank 1, where (p, q) is its first non-zero
+	// element, col its column q and row its line p (divided by their gcd).
+	int pivot = 0;
+	while (pivot < n2 && coef[pivot] == 0)
+		pivot++;
+	if (pivot == n2)
+		return 1;
+	int p = pivot / size, q = pivot % size;
+	for (int i = 0; i < size; i++)
+		for (int j = 0; j < size; j++)
+			if (coef[i * size + j] * coef[pivot] !=
+				coef[i * size + q] * coef[p * size + j])
+				return 1;
+
+	long long *col = (long long *)malloc(size * sizeof(long long));
+	long long *row = (long long *)malloc(size * sizeof(long long));
+	if (!col || !row) {
+		free(col);
+		free(row);
+		return 1;
+	}
+	long long g_col = 0, g_row = 0;
+	for (int k = 0; k < size; k++) {
+		col[k] = coef[k * size + q];
+		row[k] = coef[p * size + k];
+		g_col = gcd_ll(g_col, col[k]);
+		g_row = gcd_ll(g_row, row[k]);
+	}
+	double col_sum = 0, row_sum = 0;
+	for (int k = 0; k < size; k++) {
+		col[k] /= g_col;
+		row[k] /= g_row;
+		col_sum += llabs(col[k]);
+		row_sum += llabs(row[k]);
+	}
+	if (!big_kernel_fits(col_sum * row_sum, g_col * g_row)) {
+		free(col);
+		free(row);
+		return 1;
+	}
+	kernel->type = BIG_SEPARABLE;
+	kernel->col = col;
+	kernel->row = row;
+	big_kernel_ratio(kernel, g_col * g_row, coef[pivot] * divisor);
+	return 1;
+}
+
+static inline int big_round(big_kernel_struct *kernel, long long sum,
+							int max_value)
+{
+	// round(sum * num / den), clamped in [0, max_value]. The ties go up, just
+	// like round() does for positive numbers.
+	long long product = sum * kernel->num;
+	if (product <= 0)
+		return 0;
+	long long value = (2 * product + kernel->den) / (2 * kernel->den);
+	return value > max_value ? max_value : (int)value;
+}
+
+struct big_job_struct {
+	image_struct *initial;
+	image_struct *result;
+	big_kernel_struct *kernel;
+	int i_min, i_max, j_min, j_max;
+	int nr_bands;
+	unsigned char *scratch;	 // the memory of every band, scratch_size each
+	size_t scratch_size;
+};
+
+typedef struct big_job_struct big_job_struct;
+
+void big_band_direct(big_job_struct *job, unsigned char *scratch,
+					 int i_start, int i_end)
+{
+	// Every sample is the sum of all the size * size products.
+	image_struct *initial = job->initial;
+	big_kernel_struct *kernel = job->kernel;
+	int n = kernel->size, radius = n / 2;
+	int ch = initial->channels, depth = initial->depth;
+	unsigned char **rows = (unsigned char **)scratch;
+
+	for (int r = i_start; r < i_end; r++) {
+		for (int i = 0; i < n; i++)
+			rows[i] = row_ptr(initial, r - radius + i);
+		unsigned char *out = row_ptr(job->result, r);
+		for (int p = job->j_min * ch; p < job->j_max * ch; p++) {
+			int value;
+			if (kernel->type == BIG_DOUBLE) {
+				double sum = 0.0;
+				for (int i = 0; i < n; i++)
+					for (int j = 0; j < n; j++)
+						sum += kernel->mat[i * n + j] *
+							   row_sample(rows[i], depth,
+										  p + (j - radius) * ch);
+				value = clamp(round(sum), 0, initial->max_value);
+			} else {
+				long long sum = 0;
+				for (int i = 0; i < n; i++)
+					for (int j = 0; j < n; j++)
+						sum += kernel->coef[i * n + j] *
+							   row_sample(rows[i], depth,
+										  p + (j - radius) * ch);
+				value = big_round(kernel, sum, initial->max_value);
+			}
+			store_sample(out, depth, p, value);
+		}
+	}
+}
+
+void big_band_separable(big_job_struct *job, unsigned char *scratch,
+						int i_start, int i_end)
+{
+	// First every line is convolved with "row", keeping the sums for the
+	// last size lines in a ring. Then every sample of the result is the sum
+	// of "col" multiplied by the sums above and below it: 2 * size products
+	// per sample instead of size * size.
+	image_struct *initial = job->initial;
+	big_kernel_struct *kernel = job->kernel;
+	int n = kernel->size, radius = n / 2;
+	int ch = initial->channels, depth = initial->depth;
+	int s0 = job->j_min * ch;
+	int nr_samples = (job->j_max - job->j_min) * ch;
+	long long *ring = (long long *)scratch;
+	long long *sum = ring + (size_t)n * nr_samples;
+
+	for (int hr = i_start - radius; hr < i_end + radius; hr++) {
+		unsigned char *row = row_ptr(initial, hr);
+		long long *h = ring + (size_t)(hr % n) * nr_samples;
+		for (int q = 0; q < nr_samples; q++) {
+			long long s = 0;
+			for (int j = 0; j < n; j++)
+				s += kernel->row[j] *
+					 row_sample(row, depth, s0 + q + (j - radius) * ch);
+			h[q] = s;
+		}
+
+		// The lines r - radius, ..., r + radius are in the ring.
+		int r = hr - radius;
+		if (r < i_start)
+			continue;
+		memset(sum, 0, nr_samples * sizeof(long long));
+		for (int i = 0; i < n; i++) {
+			long long *h_i = ring + (size_t)((r - radius + i) % n) * nr_samples;
+			for (int q = 0; q < nr_samples; q++)
+				sum[q] += kernel->col[i] * h_i[q];
+		}
+		unsigned char *out = row_ptr(job->result, r);
+		for (int q = 0; q < nr_samples; q++)
+			store_sample(out, depth, s0 + q,
+						 big_round(kernel, sum[q], initial->max_value));
+	}
+}
+
+void big_band_box(big_job_struct *job, unsigned char *scratch, int i_start,
+				  int i_end)
+{
+	// For every column, we keep the sum of the size samples around the
+	// current line. Going to the next line adds the sample that enters the
+	// window and subtracts the one that leaves it. The same is done along
+	// the line with the sums of the columns, so the cost of a sample does
+	// not depend on the radius.
+	image_struct *initial = job->initial;
+	big_kernel_struct *kernel = job->kernel;
+	int n = kernel->size, radius = n / 2;
+	int ch = initial->channels, depth = initial->depth;
+	int c0 = (job->j_min - radius) * ch;  // the first sample in a window
+	int nr_samples = (job->j_max + radius) * ch - c0;
+	long long *col_sum = (long long *)scratch;
+	memset(col_sum, 0, nr_samples * sizeof(long long));
+
+	for (int i = i_start - radius; i <= i_start + radius; i++) {
+		unsigned char *row = row_ptr(initial, i);
+		for (int q = 0; q < nr_samples; q++)
+			col_sum[q] += row_sample(row, depth, c0 + q);
+	}
+
+	for (int r = i_start; r < i_end; r++) {
+		unsigned char *out = row_ptr(job->result, r);
+		for (int c = 0; c < ch; c++) {
+			long long window = 0;
+			for (int k = 0; k < n; k++)
+				window += col_sum[k * ch + c];
+			for (int j = job->j_min; j < job->j_max; j++) {
+				store_sample(out, depth, j * ch + c,
+							 big_round(kernel, window, initial->max_value));
+				if (j + 1 < job->j_max)
+					window += col_sum[(j + 1 + radius) * ch + c - c0] -
+							  col_sum[(j - radius) * ch + c - c0];
+			}
+		}
+
+		if (r + 1 < i_end) {
+			unsigned char *enter = row_ptr(initial, r + radius + 1);
+			unsigned char *leave = row_ptr(initial, r - radius);
+			for (int q = 0; q < nr_samples; q++)
+				col_sum[q] += row_sample(enter, depth, c0 + q) -
+							  row_sample(leave, depth, c0 + q);
+		}
+	}
+}
+
+void big_band(void *arg, int index)
+{
+	big_job_struct *job = (big_job_struct *)arg;
+	int nr_rows = job->i_max - job->i_min;
+	int i_start = job->i_min + (int)((long long)nr_rows * index / job->nr_bands);
+	int i_end =
+		job->i_min + (int)((long long)nr_rows * (index + 1) / job->nr_bands);
+	unsigned char *scratch = job->scratch + job->scratch_size * index;
+
+	if (job->kernel->type == BIG_SEPARABLE)
+		big_band_separable(job, scratch, i_start, i_end);
+	else if (job->kernel->type == BIG_BOX)
+		big_band_box(job, scratch, i_start, i_end);
+	else
+		big_band_direct(job, scratch, i_start, i_end);
+}
+
+int convolve_big(image_struct *initial, image_struct *result,
+				 big_kernel_struct *kernel)
+{
+	// Like for the 3x3 kernels, the pixels closer than the radius to the
+	// borders of the image don't change. The memory every band needs is
+	// allocated first: returns 0, with result left as it was, if it can't
+	// be.
+	int radius = kernel->size / 2;
+	big_job_struct job;
+	job.initial = initial;
+	job.result = result;
+	job.kernel = kernel;
+	job.i_min = initial->select->y1 > radius ? initial->select->y1 : radius;
+	job.j_min = initial->select->x1 > radius ? initial->select->x1 : radius;
+	job.i_max = initial->select->y2 < initial->height - radius
+					? initial->select->y2
+					: initial->height - radius;
+	job.j_max = initial->select->x2 < initial->width - radius
+					? initial->select->x2
+					: initial->width - radius;
+	if (job.i_max <= job.i_min || job.j_max <= job.j_min)
+		return 1;
+
+	// The lines of the ring of sums, the sums of the columns, or the lines
+	// the kernel covers.
+	size_t nr_samples = (size_t)(job.j_max - job.j_min) * initial->channels;
+	if (kernel->type == BIG_SEPARABLE)
+		job.scratch_size = (kernel->size + 1) * nr_samples * sizeof(long long);
+	else if (kernel->type == BIG_BOX)
+		job.scratch_size = (nr_samples + 2 * radius * initial->channels) *
+						   sizeof(long long);
+	else
+		job.scratch_size = kernel->size * sizeof(unsigned char *);
+	job.nr_bands = pool_bands(job.i_max - job.i_min, 4 * kernel->size);
+	job.scratch = (unsigned char *)malloc(job.scratch_size * job.nr_bands);
+	if (!job.scratch) {
+		fprintf(stderr, "malloc() for the bands failed\n");
+		return 0;
+	}
+	pool_run(big_band, &job, job.nr_bands);
+	free(job.scratch);
+	return 1;
+}
+
+int parse_coefficient(char *word, double *value)
+{
+	// A coefficient is a number, like "-1" or "0.25", or a fraction, like
+	// "1/9".
+	char *end;
+	*value = strtod(word, &end);
+	if (end == word)
+		return 0;
+	if (*end == '/') {
+		char *denominator = end + 1;
+		double den = strtod(denominator, &end);
+		if (end == denominator || den == 0)
+			return 0;
+		*value /= den;
+	}
+	return *end == '\0';
+}
+
+int parse_big_kernel(char *apply_type, words_struct *words,
+					 big_kernel_struct *kernel, double custom[][3], int *is_big)
+{
+	// Reads the parameters of CUSTOM, BOX_BLUR and GAUSSIAN. A 3x3 CUSTOM
+	// kernel is put in "custom" and is treated like the named ones, the
+	// others are large kernels. Returns 0 if a parameter is invalid and -1
+	// if the size is not a number ("Invalid command").
+	char *parameter = next_word(words);
+	if (!parameter)
+		return 0;
+	char *end;
+	errno = 0;
+	long number = strtol(parameter, &end, 10);
+	if (end == parameter || *end != '\0')
+		return -1;
+	if (errno == ERANGE)
+		return 0;
+	*is_big = 1;
+
+	if (strcmp(apply_type, "BOX_BLUR") == 0) {
+		if (number < 1 || number > NMAX_RADIUS)
+			return 0;
+		return big_kernel_box(kernel, number);
+	}
+	if (strcmp(apply_type, "GAUSSIAN") == 0) {
+		if (number < 1 || number > NMAX_RADIUS)
+			return 0;
+		return big_kernel_gaussian(kernel, number);
+	}
+
+	// CUSTOM n followed by n * n coefficients, line by line. A 1x1 kernel
+	// has no border to leave alone, so it is not accepted.
+	if (number < 3 || number > NMAX_KERNEL_SIZE || number % 2 == 0)
+		return 0;
+	double mat[NMAX_KERNEL_SIZE * NMAX_KERNEL_SIZE];
+	for (int k = 0; k < number * number; k++) {
+		char *word = next_word(words);
+		if (!word || parse_coefficient(word, &mat[k]) == 0)
+			return 0;
+	}
+	if (number == 3) {
+		*is_big = 0;
+		for (int k = 0; k < 9; k++)
+			custom[k / 3][k % 3] = mat[k];
+		return 1;
+	}
+	return big_kernel_custom(kernel, mat, number);
+}
+
+const named_kernel_struct *find_kernel(char *name)
+{
+	for (int k = 0; k < NR_NAMED_KERNELS; k++)
+		if (strcmp(name, named_kernels[k].name) == 0)
+			return &named_kernels[k];
+	return NULL;
+}
+
+// ===========================
+// TILE SNAPSHOTS
+// ===========================
+
+// The side of the square tiles the history keeps, in pixels.
+#define HISTORY_TILE 64
+
+struct tiles_struct {
+	select_struct rect;	  // whole tiles, cut at the borders of the image
+	size_t row_size;	  // bytes of a line of rect
+	unsigned char *data;  // the lines of rect, one after the other
+};
+
+typedef struct tiles_struct tiles_struct;
+
+tiles_struct *tiles_snapshot(image_struct *image, select_struct rect)
+{
+	// Copies the tiles that rect touches, before they are changed. The
+	// other tiles of the image are not kept.
+	tiles_struct *tiles = (tiles_struct *)malloc(sizeof(tiles_struct));
+	if (!tiles) {
+		fprintf(stderr, "malloc() for tiles failed\n");
+		return NULL;
+	}
+	tiles->rect.x1 = rect.x1 / HISTORY_TILE * HISTORY_TILE;
+	tiles->rect.y1 = rect.y1 / HISTORY_TILE * HISTORY_TILE;
+	tiles->rect.x2 = (rect.x2 + HISTORY_TILE - 1) / HISTORY_TILE *
+					 HISTORY_TILE;
+	tiles->rect.y2 = (rect.y2 + HISTORY_TILE - 1) / HISTORY_TILE *
+					 HISTORY_TILE;
+	if (tiles->rect.x2 > image->width)
+		tiles->rect.x2 = image->width;
+	if (tiles->rect.y2 > image->height)
+		tiles->rect.y2 = image->height;
+
+	int height = tiles->rect.y2 - tiles->rect.y1;
+	tiles->row_size = (size_t)(tiles->rect.x2 - tiles->rect.x1) *
+					  pixel_size(image);
+	tiles->data = (unsigned char *)malloc(tiles->row_size * height);
+	if (!tiles->data) {
+		fprintf(stderr, "malloc() for tiles failed\n");
+		free(tiles);
+		return NULL;
+	}
+	pthread_mutex_lock(&spares.lock);
+	counters.allocated += tiles->row_size * height;
+	pthread_mutex_unlock(&spares.lock);
+	for (int i = 0; i < height; i++)
+		memcpy(tiles->data + i * tiles->row_size,
+			   pixel_ptr(image, tiles->rect.y1 + i, tiles->rect.x1),
+			   tiles->row_size);
+	return tiles;
+}
+
+size_t tiles_bytes(tiles_struct *tiles)
+{
+	if (!tiles)
+		return 0;
+	return tiles->row_size * (tiles->rect.y2 - tiles->rect.y1);
+}
+
+int tiles_swap(image_struct *image, tiles_struct *tiles)
+{
+	// Puts the kept tiles back in the image and keeps the pixels they
+	// replace instead, so swapping again redoes the change.
+	if (unshare_data(image) == 0)
+		return 0;
+	for (int i = tiles->rect.y1; i < tiles->rect.y2; i++) {
+		unsigned char *kept = tiles->data + (i - tiles->rect.y1) *
+											tiles->row_size;
+		unsigned char *pixels = pixel_ptr(image, i, tiles->rect.x1);
+		for (size_t b = 0; b < tiles->row_size; b++) {
+			unsigned char aux = kept[b];
+			kept[b] = pixels[b];
+			pixels[b] = aux;
+		}
+	}
+	return 1;
+}
+
+void free_tiles(tiles_struct *tiles)
+{
+	if (!tiles)
+		return;
+	free(tiles->data);
+	free(tiles);
+}
+
+// ===========================
+// DEFERRED APPLY
+// ===========================
+
+struct op_struct {
+	char text[NMAX_STAGES * 16];  // the kernels, for --explain
+	const char *names[NMAX_STAGES];	 // the kernels, for the messages
+	select_struct select;	// the selection when APPLY was given
+	int nr_stages;	// 3x3 kernels applied one after the other, 0 for big
+	stage_struct stages[NMAX_STAGES];
+	double custom[NMAX_STAGES][3][3];  // the 3x3 CUSTOM matrices
+	big_kernel_struct big;	// the large kernel when nr_stages is 0
+	select_struct work;	 // the pixels that really need to be computed
+	int refs;	// kept by the waiting list and by the history
+	int done;	// computed on the whole image
+	tiles_struct *tiles;  // what it changed, once done, for UNDO
+	int lost;	// done, but its tiles could not be kept (or computed)
+	int failed;	 // its pass could not be computed, which was said once
+};
+
+typedef struct op_struct op_struct;
+
+struct pending_struct {
+	op_struct *ops[NMAX_PENDING];
+	int nr_ops;
+};
+
+typedef struct pending_struct pending_struct;
+
+// The APPLY commands given since the pixels were last needed.
+pending_struct pending;
+
+int op_radius(op_struct *op)
+{
+	// How far from a pixel its new value can look.
+	return op->nr_stages ? op->nr_stages : op->big.size / 2;
+}
+
+void free_op(op_struct *op)
+{
+	// The APPLY is freed when neither the waiting list nor the history
+	// keeps it anymore.
+	if (--op->refs > 0)
+		return;
+	if (op->nr_stages == 0)
+		free_big_kernel(&op->big);
+	free_tiles(op->tiles);
+	free(op);
+}
+
+op_struct *copy_op(op_struct *template)
+{
+	// A new APPLY with the kernels of the template. Its 3x3 CUSTOM kernels
+	// are its own copies of the matrices.
+	op_struct *op = (op_struct *)malloc(sizeof(op_struct));
+	if (!op) {
+		fprintf(stderr, "malloc() for op failed\n");
+		return NULL;
+	}
+	memcpy(op, template, sizeof(op_struct));
+	for (int k = 0; k < op->nr_stages; k++)
+		if (template->stages[k].mat == template->custom[k])
+			op->stages[k].mat = op->custom[k];
+	if (op->nr_stages == 0 && copy_big_kernel(&op->big, &template->big) == 0) {
+		free(op);
+		return NULL;
+	}
+	op->refs = 1;
+	op->done = 0;
+	op->tiles = NULL;
+	return op;
+}
+
+void drop_pending(char *reason)
+{
+	// The image is not used anymore, so the APPLY commands are never done.
+	if (options.explain && pending.nr_ops)
+		fprintf(stderr, "plan for %s: %d APPLY dropped, never used\n",
+				reason, pending.nr_ops);
+	for (int k = 0; k < pending.nr_ops; k++)
+		free_op(pending.ops[k]);
+	pending.nr_ops = 0;
+}
+
+int rect_empty(select_struct *r)
+{
+	return r->x1 >= r->x2 || r->y1 >= r->y2;
+}
+
+select_struct rect_intersect(select_struct a, select_struct b)
+{
+	select_struct r;
+	r.x1 = a.x1 > b.x1 ? a.x1 : b.x1;
+	r.y1 = a.y1 > b.y1 ? a.y1 : b.y1;
+	r.x2 = a.x2 < b.x2 ? a.x2 : b.x2;
+	r.y2 = a.y2 < b.y2 ? a.y2 : b.y2;
+	return r;
+}
+
+select_struct rect_union(select_struct a, select_struct b)
+{
+	// The smallest rectangle that covers both.
+	if (rect_empty(&a))
+		return b;
+	if (rect_empty(&b))
+		return a;
+	select_struct r;
+	r.x1 = a.x1 < b.x1 ? a.x1 : b.x1;
+	r.y1 = a.y1 < b.y1 ? a.y1 : b.y1;
+	r.x2 = a.x2 > b.x2 ? a.x2 : b.x2;
+	r.y2 = a.y2 > b.y2 ? a.y2 : b.y2;
+	return r;
+}
+
+select_struct plan_pending(image_struct *image, select_struct output)
+{
+	// Goes back from the last APPLY to the first one. The last one only has
+	// to compute the pixels of its selection that are in the output, the
+	// one before it only has to compute the pixels that the last one reads
+	// or keeps, and so on. An APPLY with nothing to compute is dead. Returns
+	// the part of the image the first one reads.
+	select_struct whole = {0, image->width, 0, image->height};
+	select_struct need = output;
+	for (int k = pending.nr_ops - 1; k >= 0; k--) {
+		op_struct *op = pending.ops[k];
+
+		// All the 3x3 kernels of an APPLY are computed on the same pixels,
+		// so the first one has to cover what the others read: one more
+		// pixel around for every kernel after it.
+		int grow = op->nr_stages ? op->nr_stages - 1 : 0;
+		select_struct around = {need.x1 - grow, need.x2 + grow,
+								need.y1 - grow, need.y2 + grow};
+		op->work = rect_intersect(op->select, around);
+		if (rect_empty(&op->work))
+			continue;
+		int r = op_radius(op) - grow;
+		select_struct reads = {op->work.x1 - r, op->work.x2 + r,
+							   op->work.y1 - r, op->work.y2 + r};
+		need = rect_union(need, rect_intersect(reads, whole));
+	}
+	return need;
+}
+
+image_struct *image_view(image_struct *image, select_struct rect)
+{
+	// A new image made of the pixels of rect. Nothing is copied: its data
+	// points inside the buffer of the initial image and keeps the same
+	// distance between lines. The buffer is freed when no image uses it
+	// anymore.
+	image_struct *result;
+	if (image_alloc(&result) == 0)
+		return NULL;
+
+	strcpy(result->image_type, image->image_type);
+	result->max_value = image->max_value;
+	result->height = rect.y2 - rect.y1;
+	result->width = rect.x2 - rect.x1;
+	result->channels = image->channels;
+	result->depth = image->depth;
+	result->stride = image->stride;
+	result->data = pixel_ptr(image, rect.y1, rect.x1);
+	result->buffer = image->buffer;
+	result->buffer->refs++;
+
+	if (select_alloc(&result->select) == 0)
+		return NULL;
+	result->select->x1 = 0;
+	result->select->x2 = result->width;
+	result->select->y1 = 0;
+	result->select->y2 = result->height;
+	return result;
+}
+
+image_struct *execute_pending(image_struct *image, select_struct output,
+							  select_struct *window, char *reason, int record,
+							  int keep)
+{
+	// Does the APPLY commands, but only where it matters for the pixels of
+	// output. Returns the part "window" of the image, with the APPLY done.
+	// The image itself is kept, but once its pixels have been copied they
+	// are released (data becomes NULL), like the eager APPLY used to do,
+	// unless "keep" is set. With "record" (only for the whole image), every
+	// APPLY keeps the tiles it changes, so it can be undone on its own.
+	// Without a reason, --explain prints nothing.
+	int explain = options.explain && reason;
+	*window = plan_pending(image, output);
+	select_struct whole = {0, image->width, 0, image->height};
+	int full = memcmp(window, &whole, sizeof(whole)) == 0;
+	if (explain)
+		fprintf(stderr, "plan for %s: read %d %d %d %d of %dx%d\n", reason,
+				window->x1, window->y1, window->x2, window->y2,
+				image->width, image->height);
+
+	// We work on a view of the window: its own borders are never computed,
+	// but the ones that are not borders of the image are only read.
+	image_struct *base = full ? image : image_view(image, *window);
+	for (int k = 0; k < pending.nr_ops;) {
+		op_struct *op = pending.ops[k];
+		if (rect_empty(&op->work)) {
+			if (explain)
+				fprintf(stderr, "  APPLY %s: dead, nothing needed\n",
+						op->text);
+			k++;
+			continue;
+		}
+
+		// The next APPLY commands with 3x3 kernels and the same selection
+		// are done in the same pass, over the pixels the first one needs.
+		stage_struct stages[NMAX_STAGES];
+		int nr_stages = 0, next = k;
+		if (op->nr_stages)
+			while (next < pending.nr_ops && (!record || next == k)) {
+				op_struct *other = pending.ops[next];
+				if (rect_empty(&other->work)) {
+					next++;
+					continue;
+				}
+				if (other->nr_stages == 0 ||
+					nr_stages + other->nr_stages > NMAX_STAGES ||
+					memcmp(&other->select, &op->select,
+						   sizeof(select_struct)) != 0)
+					break;
+				memcpy(stages + nr_stages, other->stages,
+					   other->nr_stages * sizeof(stage_struct));
+				nr_stages += other->nr_stages;
+				if (explain && other != op)
+					fprintf(stderr, "  APPLY %s: fused with the one above\n",
+							other->text);
+				next++;
+			}
+		else
+			next = k + 1;
+		if (explain)
+			fprintf(stderr, "  APPLY %s: compute %d %d %d %d\n", op->text,
+					op->work.x1, op->work.y1, op->work.x2, op->work.y2);
+
+		base->select->x1 = op->work.x1 - window->x1;
+		base->select->x2 = op->work.x2 - window->x1;
+		base->select->y1 = op->work.y1 - window->y1;
+		base->select->y2 = op->work.y2 - window->y1;
+		// Without memory for the result, the APPLY commands of the pass are
+		// not done and the pixels stay as they are. Base doesn't change, so
+		// the tiles for UNDO are taken once the pass is done.
+		image_struct *result = copy_image(base);
+		int done = result != NULL;
+		if (done && nr_stages)
+			done = convolve(base, result, stages, nr_stages, options.isa);
+		else if (done)
+			done = convolve_big(base, result, &op->big);
+		if (!done) {
+			// The command that needs the pixels says so before its own
+			// message, since APPLY already said it was done.
+			for (int m = k; m < next; m++) {
+				op_struct *other = pending.ops[m];
+				if (!other->failed && !rect_empty(&other->work)) {
+					printf("Failed to apply %s\n", other->text);
+					other->failed = 1;
+				}
+			}
+			if (result)
+				free_img(result);
+			op->lost = record;
+			k = next;
+			continue;
+		}
+		if (record) {
+			op->tiles = tiles_snapshot(base, op->work);
+			op->lost = !op->tiles;
+		}
+		// Every kernel of the pass goes over all the pixels of the work.
+		counters.pixels += (long long)(op->work.x2 - op->work.x1) *
+						   (op->work.y2 - op->work.y1) *
+						   (nr_stages ? nr_stages : 1);
+		if (base != image)
+			free_img(base);
+		else if (!keep)
+			free_data(image);
+		base = result;
+		k = next;
+	}
+
+	for (int k = 0; k < pending.nr_ops; k++) {
+		pending.ops[k]->done = record;
+		free_op(pending.ops[k]);
+	}
+	pending.nr_ops = 0;
+	return base;
+}
+
+// ===========================
+// HISTORY
+// ===========================
+
+// What an edit kept to be undone.
+#define STEP_APPLY 0  // an APPLY, waiting or done (then op->tiles)
+#define STEP_TILES 1  // the tiles changed in place (EQUALIZE, ROTATE)
+#define STEP_IMAGE 2  // the whole image was replaced (CROP, ROTATE)
+
+struct step_struct {
+	int type;		   // STEP_*
+	const char *name;  // the command, for the messages
+	op_struct *op;	   // STEP_APPLY
+	tiles_struct *tiles;  // STEP_TILES
+	image_struct *image;  // STEP_IMAGE: the other image
+	pending_struct pending;	 // and the APPLY commands waiting for it
+};
+
+typedef struct step_struct step_struct;
+
+struct history_struct {
+	step_struct **undo;	 // from the oldest step to the last one
+	int nr_undo, size_undo;
+	step_struct **redo;	 // the last undone step at the end
+	int nr_redo, size_redo;
+};
+
+typedef struct history_struct history_struct;
+
+// The edits done on the loaded image.
+history_struct history;
+
+size_t step_bytes(step_struct *step)
+{
+	// The memory kept only for the step.
+	switch (step->type) {
+		case STEP_APPLY:
+			return tiles_bytes(step->op->tiles);
+		case STEP_TILES:
+			return tiles_bytes(step->tiles);
+		default:
+			return step->image->stride * step->image->height;
+	}
+}
+
+size_t history_bytes(void)
+{
+	size_t bytes = 0;
+	for (int k = 0; k < history.nr_undo; k++)
+		bytes += step_bytes(history.undo[k]);
+	for (int k = 0; k < history.nr_redo; k++)
+		bytes += step_bytes(history.redo[k]);
+	return bytes;
+}
+
+void free_step(step_struct *step)
+{
+	if (step->type == STEP_APPLY) {
+		free_op(step->op);
+	} else if (step->type == STEP_TILES) {
+		free_tiles(step->tiles);
+	} else {
+		free_img(step->image);
+		for (int k = 0; k < step->pending.nr_ops; k++)
+			free_op(step->pending.ops[k]);
+	}
+	free(step);
+}
+
+void history_trim(void)
+{
+	// While the history uses more memory than allowed, we forget the oldest
+	// step: the edits before it can't be undone anymore. The steps to redo
+	// go last, the furthest one first.
+	size_t limit = (size_t)options.history << 20;
+	while (history.nr_undo + history.nr_redo > 0 &&
+		   history_bytes() > limit) {
+		if (history.nr_undo) {
+			free_step(history.undo[0]);
+			history.nr_undo--;
+			memmove(history.undo, history.undo + 1,
+					history.nr_undo * sizeof(step_struct *));
+		} else {
+			free_step(history.redo[0]);
+			history.nr_redo--;
+			memmove(history.redo, history.redo + 1,
+					history.nr_redo * sizeof(step_struct *));
+		}
+	}
+}
+
+void clear_redo(void)
+{
+	// A new edit: the undone steps can't be redone anymore.
+	for (int k = 0; k < history.nr_redo; k++)
+		free_step(history.redo[k]);
+	history.nr_redo = 0;
+}
+
+void history_clear(void)
+{
+	clear_redo();
+	for (int k = 0; k < history.nr_undo; k++)
+		free_step(history.undo[k]);
+	history.nr_undo = 0;
+}
+
+int history_forget(history_struct *steps, struct stat *st)
+{
+	// The file is about to be written over: the images kept by the steps of
+	// CROP and ROTATE that still have their pixels in its mapping get a copy
+	// of their own, so that UNDO and REDO don't read the new file. Returns 0
+	// if a copy could not be made: then the file must not be written.
+	step_struct **stacks[2] = {steps->undo, steps->redo};
+	int nr_steps[2] = {steps->nr_undo, steps->nr_redo};
+	for (int s = 0; s < 2; s++)
+		for (int k = 0; k < nr_steps[s]; k++) {
+			step_struct *step = stacks[s][k];
+			if (step->type != STEP_IMAGE)
+				continue;
+			mapping_struct *mapping = step->image->buffer->mapping;
+			if (mapping && mapping->dev == st->st_dev &&
+				mapping->ino == st->st_ino && own_data(step->image) == 0)
+				return 0;
+		}
+	return 1;
+}
+
+int stack_push(step_struct ***steps, int *nr, int *size, step_struct *step)
+{
+	if (*nr == *size) {
+		int new_size = *size ? 2 * *size : 16;
+		step_struct **aux = (step_struct **)realloc(*steps, new_size *
+													sizeof(step_struct *));
+		if (!aux) {
+			fprintf(stderr, "realloc() for history failed\n");
+			return 0;
+		}
+		*steps = aux;
+		*size = new_size;
+	}
+	(*steps)[(*nr)++] = step;
+	return 1;
+}
+
+step_struct *new_step(int type, const char *name)
+{
+	// Returns NULL when there is no history to keep.
+	if (options.history == 0)
+		return NULL;
+	step_struct *step = (step_struct *)calloc(1, sizeof(step_struct));
+	if (!step) {
+		fprintf(stderr, "calloc() for step failed\n");
+		return NULL;
+	}
+	step->type = type;
+	step->name = name;
+	return step;
+}
+
+void history_push(step_struct *step)
+{
+	// Adds the step of a new edit. Without it (not enough memory), the steps
+	// before could not be undone correctly anymore, so they are forgotten.
+	clear_redo();
+	if (!step || stack_push(&history.undo, &history.nr_undo,
+							&history.size_undo, step) == 0) {
+		if (step)
+			free_step(step);
+		history_clear();
+		return;
+	}
+	history_trim();
+}
+
+void history_apply(op_struct *op)
+{
+	// The APPLY is waiting: undoing it only takes it out of the list.
+	if (options.history == 0)
+		return;
+	step_struct *step = new_step(STEP_APPLY, "APPLY");
+	if (step) {
+		step->op = op;
+		op->refs++;
+	}
+	history_push(step);
+}
+
+void history_tiles(image_struct *image, select_struct rect, const char *name)
+{
+	// Keeps the tiles of rect before an edit changes them in place.
+	if (options.history == 0)
+		return;
+	step_struct *step = new_step(STEP_TILES, name);
+	if (step) {
+		step->tiles = tiles_snapshot(image, rect);
+		if (!step->tiles) {
+			free(step);
+			step = NULL;
+		}
+	}
+	history_push(step);
+}
+
+void history_image(image_struct *image, pending_struct *waiting,
+				   const char *name)
+{
+	// Keeps the whole image an edit replaced, with the APPLY commands that
+	// were still waiting for it (they were done only on the new image).
+	step_struct *step = new_step(STEP_IMAGE, name);
+	if (!step) {
+		free_img(image);
+		for (int k = 0; k < waiting->nr_ops; k++)
+			free_op(waiting->ops[k]);
+	} else {
+		step->image = image;
+		step->pending = *waiting;
+	}
+	history_push(step);
+}
+
+image_struct *swap_step(image_struct *image, step_struct *step, int undoing)
+{
+	// Undoes or redoes the step. Everything is swapped, so the step then
+	// keeps what is needed to do the opposite.
+	if (step->type == STEP_APPLY && !step->op->done) {
+		// A waiting APPLY is always the last one of the list.
+		if (undoing) {
+			pending.nr_ops--;
+			free_op(step->op);
+		} else {
+			step->op->refs++;
+			pending.ops[pending.nr_ops++] = step->op;
+		}
+	} else if (step->type == STEP_APPLY) {
+		if (step->op->tiles)
+			tiles_swap(image, step->op->tiles);
+	} else if (step->type == STEP_TILES) {
+		tiles_swap(image, step->tiles);
+	} else {
+		image_struct *aux = step->image;
+		step->image = image;
+		image = aux;
+		pending_struct waiting = step->pending;
+		step->pending = pending;
+		pending = waiting;
+	}
+	return image;
+}
+
+image_struct *undo(image_struct *image, int loaded_img_now,
+				   instr_struct *instr)
+{
+	if (instr->invalid) {	// UNDO has no parameter
+		printf("Invalid command\n");
+		return image;
+	}
+	if (loaded_img_now == 0) {
+		printf("No image loaded\n");
+		return image;
+	}
+	if (history.nr_undo == 0) {
+		printf("Nothing to undo\n");
+		return image;
+	}
+	step_struct *step = history.undo[--history.nr_undo];
+	image = swap_step(image, step, 1);
+	printf("%s undone\n", step->name);
+	if (stack_push(&history.redo, &history.nr_redo, &history.size_redo,
+				   step) == 0)
+		free_step(step);
+	return image;
+}
+
+image_struct *redo(image_struct *image, int loaded_img_now,
+				   instr_struct *instr)
+{
+	if (instr->invalid) {	// REDO has no parameter
+		printf("Invalid command\n");
+		return image;
+	}
+	if (loaded_img_now == 0) {
+		printf("No image loaded\n");
+		return image;
+	}
+	if (history.nr_redo == 0) {
+		printf("Nothing to redo\n");
+		return image;
+	}
+	step_struct *step = history.redo[--history.nr_redo];
+	image = swap_step(image, step, 0);
+	printf("%s redone\n", step->name);
+	// There is room: the step came from there.
+	stack_push(&history.undo, &history.nr_undo, &history.size_undo, step);
+	return image;
+}
+
+void show_history(int loaded_img_now, instr_struct *instr)
+{
+	if (instr->invalid) {	// HISTORY has no parameter
+		printf("Invalid command\n");
+		return;
+	}
+	if (loaded_img_now == 0) {
+		printf("No image loaded\n");
+		return;
+	}
+	size_t bytes = history_bytes();
+	printf("History: %d to undo, %d to redo, %zu KB used of %d MB\n",
+		   history.nr_undo, history.nr_redo, (bytes + 1023) >> 10,
+		   options.history);
+}
+
+void run_pending(image_struct *image, char *reason)
+{
+	// The pixels of the whole image are needed: we do the APPLY commands and
+	// put the result in place of the old pixels, keeping the selection.
+	// Every APPLY keeps what it changed for UNDO.
+	if (pending.nr_ops == 0)
+		return;
+	select_struct whole = {0, image->width, 0, image->height};
+	select_struct select = *image->select;
+	select_struct window;
+	int record = options.history > 0;
+	image_struct *result = execute_pending(image, whole, &window, reason,
+										   record, 0);
+	if (result != image) {
+		free_data(image);
+		image->data = result->data;
+		image->stride = result->stride;
+		image->buffer = result->buffer;
+		result->buffer = NULL;
+		free_img(result);
+	}
+	*image->select = select;
+	if (!record)
+		return;
+	// An APPLY whose tiles could not be kept can't be undone, and the edits
+	// before it can't be undone correctly anymore: like when a step can't
+	// be kept (history_push), they are all forgotten.
+	for (int k = 0; k < history.nr_undo; k++)
+		if (history.undo[k]->type == STEP_APPLY &&
+			history.undo[k]->op->lost) {
+			history_clear();
+			break;
+		}
+	history_trim();
+}
+
+void save_stream(image_struct *image, int loaded_img_now,
+				 instr_struct *instr, char *out_path)
+{
+	// A SAVE after which the image is not used: the APPLY commands that are
+	// still waiting are done band by band, and every band is written before
+	// the next one is computed, so the memory doesn't depend on the height
+	// of the image. The APPLY commands are then left waiting.
+	char *file_path = save_target(image, loaded_img_now, instr, out_path);
+	if (!file_path || instr->flag == 2)
+		return;
+	out_struct out;
+	qoi_struct qoi;
+	if (out_start(&out, image, file_path, instr->flag, &qoi) == 0)
+		return;
+	counters.pixels += (long long)image->width * image->height;
+
+	// The rows around a band that the kernels read are computed again for
+	// the next band, so the bands are made taller when there are many of
+	// them: about 1 row in 4 is computed twice, at most.
+	select_struct select = *image->select;
+	select_struct band = {0, image->width, 0, STREAM_ROWS};
+	if (band.y2 > image->height)
+		band.y2 = image->height;
+	select_struct window = plan_pending(image, band);
+	int rows = STREAM_ROWS;
+	if (rows < 8 * (window.y2 - band.y2))
+		rows = 8 * (window.y2 - band.y2);
+
+	int nr_bands = 0;
+	for (int y = 0; y < image->height; y += rows) {
+		band.y1 = y;
+		band.y2 = image->height - y > rows ? y + rows : image->height;
+		pending_struct waiting = pending;
+		for (int k = 0; k < waiting.nr_ops; k++)
+			waiting.ops[k]->refs++;
+		image_struct *part = execute_pending(image, band, &window,
+											 nr_bands ? NULL : "SAVE", 0, 1);
+		pending = waiting;
+		*image->select = select;
+		if (instr->flag == 3)
+			out_qoi_rows(&out, &qoi, part, band.y1 - window.y1,
+						 band.y2 - window.y1);
+		else if (instr->flag)
+			out_text_rows(&out, part, band.y1 - window.y1,
+						  band.y2 - window.y1);
+		else
+			out_binary_rows(&out, part, band.y1 - window.y1,
+							band.y2 - window.y1);
+		if (part != image)
+			free_img(part);
+		nr_bands++;
+	}
+	if (instr->flag == 3)
+		out_qoi_end(&out, &qoi, image);
+	int saved = out_close(&out);
+	if (options.explain)
+		fprintf(stderr, "SAVE streamed in %d bands of %d rows\n", nr_bands,
+				rows);
+	if (saved)
+		printf("Saved %s\n", file_path);
+	else
+		printf("Failed to save %s\n", file_path);
+}
+
+image_struct *apply(image_struct *image, int loaded_img_now,
+					instr_struct *instr)
+{
+	if (loaded_img_now == 0) {
+		printf("No image loaded\n");
+		return image;
+	}
+	if (instr->invalid == 1) {
+		printf("Invalid command\n");
+		return image;
+	}
+	if (instr->invalid == 2) {
+		printf("APPLY parameter invalid\n");
+		return image;
+	}
+
+	// The kernels were read with the line ("compile_apply"). Nothing is
+	// computed yet: a copy of them is kept until the pixels are needed.
+	int nr_types = instr->op->nr_stages ? instr->op->nr_stages : 1;
+	if (strcmp(image->image_type, "P2") == 0 ||
+		strcmp(image->image_type, "P5") == 0) {
+		for (int k = 0; k < nr_types; k++)
+			printf("Easy, Charlie Chaplin\n");
+		return image;
+	}
+
+	op_struct *op = copy_op(instr->op);
+	if (!op)
+		return image;
+	op->select = *image->select;
+	if (pending.nr_ops == NMAX_PENDING)
+		run_pending(image, "APPLY");
+	pending.ops[pending.nr_ops++] = op;
+	history_apply(op);
+
+	for (int k = 0; k < nr_types; k++)
+		printf("APPLY %s done\n", op->names[k]);
+	return image;
+}
+
+image_struct *crop(image_struct *initial, int loaded_img_now,
+				   instr_struct *instr)
+{
+	if (instr->invalid) {  // CROP has no other parameter
+		printf("Invalid command\n");
+		return initial;
+	}
+	if (loaded_img_now == 0) {
+		printf("No image loaded\n");
+		return initial;
+	}
+
+	// The result is a view of the selection: no pixel is copied. The APPLY
+	// commands that are still waiting are only done on the pixels the
+	// selection needs. The history keeps the initial image as it is, with
+	// the APPLY commands still waiting for it.
+	select_struct select = *initial->select;
+	pending_struct waiting = pending;
+	for (int k = 0; k < waiting.nr_ops; k++)
+		waiting.ops[k]->refs++;
+	image_struct *base = initial;
+	if (pending.nr_ops) {
+		select_struct window;
+		base = execute_pending(initial, select, &window, "CROP", 0,
+							   options.history > 0);
+		*initial->select = select;
+		select.x1 -= window.x1;
+		select.x2 -= window.x1;
+		select.y1 -= window.y1;
+		select.y2 -= window.y1;
+	}
+	image_struct *result = image_view(base, select);
+	if (base != initial)
+		free_img(base);
+
+	printf("Image cropped\n");
+	history_image(initial, &waiting, "CROP");
+	return result;
+}
+
+void equalize(image_struct *image, int loaded_img_now, instr_struct *instr)
+{
+	if (loaded_img_now == 0) {
+		printf("No image loaded\n");
+		return;
+	}
+	if (instr->invalid) {
+		printf("Invalid command\n");
+		return;
+	}
+
+	// With SELECTION, we only equalize the selection, with the frequencies of
+	// its own pixels.
+	select_struct whole = {0, image->width, 0, image->height};
+	select_struct *region = instr->flag ? image->select : &whole;
+
+	if (strcmp(image->image_type, "P3") == 0 ||
+		strcmp(image->image_type, "P6") == 0) {
+		printf("Black and white image needed\n");
+		return;
+	}
+
+	// The tiles are kept for UNDO once nothing can fail anymore.
+	void *lut = equalize_lut(image, region);
+	if (!lut || unshare_data(image) == 0) {
+		free(lut);
+		printf("Failed to equalize\n");
+		return;
+	}
+	history_tiles(image, *region, "EQUALIZE");
+	remap_region(image, region, lut);
+	free(lut);
+	printf("Equalize done\n");
+}
+
+struct rotate_job_struct {
+	image_struct *image;
+	image_struct *result;
+	int turns;	// clockwise quarter turns: 1, 2 or 3
+	int nr_bands;
+};
+
+typedef struct rotate_job_struct rotate_job_struct;
+
+static inline void rotate_rows(rotate_job_struct *job, int i_start, int i_end,
+							   int psize)
+{
+	// Moves the pixels of the lines [i_start, i_end) to their place in the
+	// result. psize is a constant in every call, so copy_pixel becomes a
+	// couple of moves.
+	image_struct *image = job->image, *result = job->result;
+	int height = image->height, width = image->width;
+
+	if (job->turns == 2) {
+		// 180 degrees: line i becomes line height - 1 - i, reversed.
+		for (int i = i_start; i < i_end; i++) {
+			unsigned char *src = row_ptr(image, i);
+			unsigned char *dst = pixel_ptr(result, height - 1 - i, width - 1);
+			for (int j = 0; j < width; j++, src += psize, dst -= psize)
+				copy_pixel(dst, src, psize);
+		}
+		return;
+	}
+
+	// 90 degrees: pixel (i, j) goes to (j, height - 1 - i), so a line becomes
+	// a column. 270 degrees: it goes to (width - 1 - j, i). We go through
+	// blocks of ROTATE_TILE x ROTATE_TILE pixels, so that the lines we read
+	// and the ones we write stay in the cache while we work on a block.
+	ptrdiff_t step = (ptrdiff_t)result->stride;
+	if (job->turns == 3)
+		step = -step;
+	for (int ti = i_start; ti < i_end; ti += ROTATE_TILE) {
+		int ti_end = ti + ROTATE_TILE < i_end ? ti + ROTATE_TILE : i_end;
+		for (int tj = 0; tj < width; tj += ROTATE_TILE) {
+			int tj_end = tj + ROTATE_TILE < width ? tj + ROTATE_TILE : width;
+			for (int i = ti; i < ti_end; i++) {
+				unsigned char *src = pixel_ptr(image, i, tj);
+				unsigned char *dst;
+				if (job->turns == 1)
+					dst = pixel_ptr(result, tj, height - 1 - i);
+				else
+					dst = pixel_ptr(result, width - 1 - tj, i);
+				for (int j = tj; j < tj_end; j++, src += psize, dst += step)
+					copy_pixel(dst, src, psize);
+			}
+		}
+	}
+}
+
+void rotate_band(void *arg, int index)
+{
+	rotate_job_struct *job = (rotate_job_struct *)arg;
+	int height = job->image->height;
+	int i_start = (int)((long long)height * index / job->nr_bands);
+	int i_end = (int)((long long)height * (index + 1) / job->nr_bands);
+
+	switch (pixel_size(job->image)) {
+		case 1:
+			rotate_rows(job, i_start, i_end, 1);
+			break;
+		case 2:
+			rotate_rows(job, i_start, i_end, 2);
+			break;
+		case 3:
+			rotate_rows(job, i_start, i_end, 3);
+			break;
+		default:
+			rotate_rows(job, i_start, i_end, 6);
+	}
+}
+
+image_struct *full_rotation(image_struct *image, int turns)
+{
+	// Rotates the whole image clockwise with "turns" quarter turns (1, 2 or
+	// 3) in a single pass, with the lines split in bands between the threads.
+	// The initial image is kept.
+	image_struct *result;
+	if (image_alloc(&result) == 0)
+		return NULL;
+
+	strcpy(result->image_type, image->image_type);
+	result->max_value = image->max_value;
+	if (turns == 2) {
+		result->height = image->height;
+		result->width = image->width;
+	} else {
+		result->height = image->width;	// We swap the height with the width.
+		result->width = image->height;
+	}
+
+	if (pixel_alloc(result) == 0)
+		return NULL;
+	if (select_alloc(&result->select) == 0)
+		return NULL;
+	*result->select = *image->select;
+	if (turns != 2) {
+		result->select->x2 = image->select->y2;
+		result->select->y2 = image->select->x2;
+	}
+
+	rotate_job_struct job;
+	job.image = image;
+	job.result = result;
+	job.turns = turns;
+	job.nr_bands = pool_bands(image->height, ROTATE_TILE);
+	pool_run(rotate_band, &job, job.nr_bands);
+	counters.pixels += (long long)image->width * image->height;
+	return result;
+}
+
+void select_rotation(image_struct *image, int turns)
+{
+	// Rotates the square selection clockwise with "turns" quarter turns (1, 2
+	// or 3) in place. Nothing else is allocated, whatever the size of the
+	// image: every pixel is moved once, through a single temporary pixel.
+	select_struct *select = image->select;
+	int n = select->x2 - select->x1;
+	int psize = pixel_size(image);
+	unsigned char tmp[6];
+	counters.pixels += (long long)n * n;
+
+	// (i, j) is the position of a pixel inside the selection.
+#define SELECTED(i, j) pixel_ptr(image, select->y1 + (i), select->x1 + (j))
+
+	if (turns == 2) {
+		// 180 degrees: the k-th pixel of the selection (line after line) is
+		// swapped with the k-th one from the end.
+		int half = n * n / 2;
+		for (int k = 0; k < half; k++) {
+			int l = n * n - 1 - k;
+			unsigned char *p = SELECTED(k / n, k % n);
+			unsigned char *q = SELECTED(l / n, l % n);
+			copy_pixel(tmp, p, psize);
+			copy_pixel(p, q, psize);
+			copy_pixel(q, tmp, psize);
+		}
+		return;
+	}
+
+	// For 90 degrees clockwise, (i, j) goes to (j, n - 1 - i), which goes to
+	// (n - 1 - i, n - 1 - j), which goes to (n - 1 - j, i) and back to (i, j).
+	// We move these four pixels around the cycle at once, for every pixel
+	// (i, j) of the top-left quarter of the "rings" of the selection.
+	for (int i = 0; i < n / 2; i++) {
+		for (int j = i; j < n - 1 - i; j++) {
+			unsigned char *a = SELECTED(i, j);
+			unsigned char *b = SELECTED(j, n - 1 - i);
+			unsigned char *c = SELECTED(n - 1 - i, n - 1 - j);
+			unsigned char *d = SELECTED(n - 1 - j, i);
+			if (turns == 1) {  // a -> b -> c -> d -> a
+				copy_pixel(tmp, d, psize);
+				copy_pixel(d, c, psize);
+				copy_pixel(c, b, psize);
+				copy_pixel(b, a, psize);
+				copy_pixel(a, tmp, psize);
+			} else {  // a -> d -> c -> b -> a
+				copy_pixel(tmp, a, psize);
+				copy_pixel(a, b, psize);
+				copy_pixel(b, c, psize);
+				copy_pixel(c, d, psize);
+				copy_pixel(d, tmp, psize);
+			}
+		}
+	}
+#undef SELECTED
+}
+
+image_struct *rotate(image_struct *image, int loaded_img_now,
+					 instr_struct *instr)
+{
+	if (loaded_img_now == 0) {
+		printf("No image loaded\n");
+		return image;
+	}
+	if (instr->invalid) {  // Needs a parameter (the angle)
+		printf("Invalid command\n");
+		return image;
+	}
+	int rotation_nr = instr->args[0];
+
+	if (rotation_nr % 90 != 0) {
+		printf("Unsupported rotation angle\n");
+		return image;
+	}
+
+	select_struct *select = image->select;	// For easier use
+
+	// We verify if the whole image is selected.
+	if (select->x1 == 0 && select->y1 == 0 && select->x2 == image->width &&
+		select->y2 == image->height) {	// FULL ROTATION
+		// Any angle is the same as 0, 90, 180 or 270 degrees clockwise
+		// (-90 is 270, 450 is 90 etc.), which is done in a single pass.
+		int turns = ((rotation_nr / 90) % 4 + 4) % 4;
+		if (turns != 0) {
+			image_struct *result = full_rotation(image, turns);
+			if (!result)
+				return image;
+			pending_struct waiting;	 // nothing waits: ROTATE did it
+			waiting.nr_ops = 0;
+			history_image(image, &waiting, "ROTATE");
+			image = result;
+		}
+		printf("Rotated %d\n", rotation_nr);
+		return image;
+	}
+	if (select->x1 != 0 || select->y1 != 0 || select->x2 != image->width ||
+		select->y2 != image->height) {	// SELECTION ROTATION
+		if (select->x2 - select->x1 != select->y2 - select->y1) {
+			printf("The selection must be square\n");
+			return image;
+		}
+
+		int turns = ((rotation_nr / 90) % 4 + 4) % 4;
+		if (turns != 0) {
+			if (unshare_data(image) == 0)
+				return image;
+			history_tiles(image, *select, "ROTATE");
+			select_rotation(image, turns);
+		}
+	}
+	printf("Rotated %d\n", rotation_nr);
+	return image;
+}
+
+int exit_program(image_struct *image, int loaded_img_now)
+{
+	// If there is an image loaded, we deallocate its memory and return 1,
+	// so in main we will be able to verify it and end the program.
+	if (loaded_img_now == 0) {
+		printf("No image loaded\n");
+		return 0;
+	}
+	free_img(image);
+	return 1;
+}
+
+void set_threads(instr_struct *instr)
+{
+	// THREADS N changes how many threads share the work of the next commands.
+	if (instr->invalid) {
+		printf("Invalid command\n");
+		return;
+	}
+	options.threads = instr->args[0];
+	pool_start(options.threads);
+	printf("Using %d threads\n", options.threads);
+}
+
+// ===========================
+// IMAGE CACHE
+// ===========================
+
+// The images decoded by LOAD, so that loading an unchanged file again reads
+// nothing. A cached image shares its pixels with the images loaded from it,
+// which copy them before changing them (unshare_data). A file is recognized
+// by its path, and is unchanged if its device, inode, size and modification
+// time are the same.
+struct cached_struct {
+	char *path;
+	struct stat st;
+	image_struct *image;  // a view of the whole image
+	size_t bytes;
+	long long used;	 // when it was last loaded, for the LRU order
+};
+
+typedef struct cached_struct cached_struct;
+
+struct cache_struct {
+	cached_struct *entries;
+	int nr_entries, size;
+	size_t bytes;  // of all the entries, at most options.cache MB
+	long long clock;
+	long long hits, misses;
+};
 
-	} else {
-		printf("Invalid set of coordinates\n");
-	}
+typedef struct cache_struct cache_struct;
+
+cache_struct cache;
+
+void cache_remove(int k)
+{
+	cached_struct *entry = &cache.entries[k];
+	free(entry->path);
+	free_img(entry->image);
+	cache.bytes -= entry->bytes;
+	cache.entries[k] = cache.entries[--cache.nr_entries];
 }
 
-void save_text(image_struct *image, char *file_path)
+void cache_clear(void)
 {
-	// This function saves the image in a text file.
-	FILE *pf = fopen(file_path, "wt");
-	if (!pf) {
-		printf("Cannot open %s\n", file_path);
+	while (cache.nr_entries)
+		cache_remove(cache.nr_entries - 1);
+	free(cache.entries);
+	cache.entries = NULL;
+	cache.size = 0;
+}
+
+void cache_add(char *path, struct stat *st, image_struct *image)
+{
+	// Keeps a view of the image just loaded. The entries loaded the longest
+	// time ago are forgotten first, until the new one fits.
+	size_t bytes = image->stride * image->height;
+	size_t limit = (size_t)options.cache << 20;
+	if (bytes > limit)
 		return;
+	while (cache.bytes + bytes > limit) {
+		int oldest = 0;
+		for (int k = 1; k < cache.nr_entries; k++)
+			if (cache.entries[k].used < cache.entries[oldest].used)
+				oldest = k;
+		cache_remove(oldest);
 	}
-
-	if (strcmp(image->image_type, "P2") == 0 ||
-		strcmp(image->image_type, "P5") == 0) {
-		fprintf(pf, "P2\n");
-		fprintf(pf, "%d %d\n", image->width, image->height);
-		fprintf(pf, "%d\n", image->max_value);
-
-		for (int i = 0; i < image->height; i++) {
-			for (int j = 0; j < image->width; j++) {
-				if (j == image->width - 1)
-					fprintf(pf, "%d\n", image->pixel[i][j].grayscale);
-				else
-					fprintf(pf, "%d ", image->pixel[i][j].grayscale);
-			}
+	if (cache.nr_entries == cache.size) {
+		int size = cache.size ? 2 * cache.size : 16;
+		cached_struct *aux = (cached_struct *)realloc(cache.entries, size *
+													  sizeof(cached_struct));
+		if (!aux) {
+			fprintf(stderr, "realloc() for cache failed\n");
+			return;
 		}
+		cache.entries = aux;
+		cache.size = size;
 	}
 
-	if (strcmp(image->image_type, "P3") == 0 ||
-		strcmp(image->image_type, "P6") == 0) {
-		fprintf(pf, "P3\n");
-		fprintf(pf, "%d %d\n", image->width, image->height);
-		fprintf(pf, "%d\n", image->max_value);
-
-		for (int i = 0; i < image->height; i++) {
-			for (int j = 0; j < image->width; j++) {
-				if (j == image->width - 1) {
-					fprintf(pf, "%d %d %d\n", image->pixel[i][j].r,
-							image->pixel[i][j].g, image->pixel[i][j].b);
-				} else {
-					fprintf(pf, "%d %d %d ", image->pixel[i][j].r,
-							image->pixel[i][j].g, image->pixel[i][j].b);
-				}
-			}
-		}
+	select_struct whole = {0, image->width, 0, image->height};
+	cached_struct *entry = &cache.entries[cache.nr_entries];
+	entry->path = strdup(path);
+	entry->image = image_view(image, whole);
+	if (!entry->path || !entry->image) {
+		fprintf(stderr, "strdup() for cache failed\n");
+		free(entry->path);
+		if (entry->image)
+			free_img(entry->image);
+		return;
 	}
+	entry->st = *st;
+	entry->bytes = bytes;
+	entry->used = ++cache.clock;
+	cache.bytes += bytes;
+	cache.nr_entries++;
+}
 
-	printf("Saved %s\n", file_path);
+image_struct *cache_load(image_struct *image, int *loaded_img_now,
+						 instr_struct *instr)
+{
+	// LOAD, through the cache. A file that changed since it was cached is
+	// loaded again.
+	char *path = instr->path;
+	struct stat st;
+	if (!path || options.cache == 0 || stat(path, &st) != 0)
+		return load(image, loaded_img_now, instr);
+
+	for (int k = 0; k < cache.nr_entries; k++) {
+		cached_struct *entry = &cache.entries[k];
+		if (strcmp(entry->path, path) != 0)
+			continue;
+		if (!same_file(&entry->st, &st)) {
+			cache_remove(k);
+			break;
+		}
+		if (*loaded_img_now == 1) {
+			free_img(image);
+			(*loaded_img_now)--;
+		}
+		select_struct whole = {0, entry->image->width, 0,
+							   entry->image->height};
+		image = image_view(entry->image, whole);
+		if (!image)
+			return NULL;
+		entry->used = ++cache.clock;
+		cache.hits++;
+		printf("Loaded %s\n", path);
+		(*loaded_img_now)++;
+		return image;
+	}
 
-	fclose(pf);
+	cache.misses++;
+	image = load(image, loaded_img_now, instr);
+	if (*loaded_img_now)
+		cache_add(path, &st, image);
+	return image;
 }
 
-void save_binary(image_struct *image, char *file_path)
+void cache_forget(struct stat *st)
 {
-	// This function saves the image in a binary file.
-	FILE *pf = fopen(file_path, "wb");
-	if (!pf) {
-		printf("Cannot open %s\n", file_path);
-		return;
+	// The file is about to be written over: the images that still have
+	// their pixels in its mapping must not see it change, and the others are
+	// out of date (the new file may have the same size and time).
+	for (int k = cache.nr_entries - 1; k >= 0; k--) {
+		struct stat *cached = &cache.entries[k].st;
+		if (cached->st_dev == st->st_dev && cached->st_ino == st->st_ino)
+			cache_remove(k);
 	}
+}
 
-	// The image type, width, height and max_value are written as ASCII.
-	if (strcmp(image->image_type, "P2") == 0 ||
-		strcmp(image->image_type, "P5") == 0)
-		fprintf(pf, "P5\n");
-	else
-		fprintf(pf, "P6\n");
-	fprintf(pf, "%d %d\n", image->width, image->height);
-	fprintf(pf, "%d\n", image->max_value);
+// ===========================
+// STATISTICS
+// ===========================
 
-	// Grayscale
-	if (strcmp(image->image_type, "P2") == 0 ||
-		strcmp(image->image_type, "P5") == 0) {
-		for (int i = 0; i < image->height; i++) {
-			// We have to transform the pixel values(ints) into chars.
-			unsigned char *v_aux =
-				(unsigned char *)malloc(sizeof(unsigned char) * image->width);
-			if (!v_aux) {
-				fprintf(stderr, "malloc() for array failed\n");
-				return;
-			}
+#define NMAX_COMMANDS 32  // commands the statistics can tell apart
 
-			for (int j = 0; j < image->width; j++)
-				v_aux[j] = (unsigned char)(image->pixel[i][j].grayscale);
+// What a command used: the times in seconds, what it added to "counters" and
+// the most memory the process has used until its end.
+struct usage_struct {
+	double wall, cpu;
+	counters_struct counters;
+	long peak_rss;	// KB
+};
 
-			fwrite(v_aux, sizeof(unsigned char), image->width, pf);
-			free(v_aux);
-		}
-	}
+typedef struct usage_struct usage_struct;
+
+// With --stats or --trace, what every command used is added to the totals of
+// its name, and written as an event of the trace.
+struct stats_struct {
+	const char *names[NMAX_COMMANDS];
+	int nr_runs[NMAX_COMMANDS];
+	usage_struct totals[NMAX_COMMANDS];
+	double start;  // when the first command could start, for the trace
+	FILE *trace;
+	int nr_events;
+};
 
-	// Colour
-	if (strcmp(image->image_type, "P3") == 0 ||
-		strcmp(image->image_type, "P6") == 0) {
-		for (int i = 0; i < image->height; i++) {
-			for (int j = 0; j < image->width; j++) {
-				// We have to transform the pixel values(ints) into chars.
-				unsigned char r, g, b;
-				r = (unsigned char)image->pixel[i][j].r;
-				g = (unsigned char)image->pixel[i][j].g;
-				b = (unsigned char)image->pixel[i][j].b;
-
-				fwrite(&r, sizeof(unsigned char), 1, pf);
-				fwrite(&g, sizeof(unsigned char), 1, pf);
-				fwrite(&b, sizeof(unsigned char), 1, pf);
-			}
-		}
-	}
+typedef struct stats_struct stats_struct;
 
-	printf("Saved %s\n", file_path);
+stats_struct stats;
 
-	fclose(pf);
+double clock_seconds(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void save(image_struct *image, int loaded_img_now, char *delim)
+long peak_rss(void)
 {
-	// File_path will be the next word on the line we previously read in main.
-	char *file_path = strtok(NULL, delim);
+	// In KB on Linux.
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	return usage.ru_maxrss;
+}
 
-	if (loaded_img_now == 0) {
-		printf("No image loaded\n");
-		return;
+void trace_string(FILE *file, const char *text)
+{
+	// Writes text as a JSON string.
+	fputc('"', file);
+	for (; *text; text++) {
+		unsigned char c = (unsigned char)*text;
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if (c < ' ')
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
 	}
+	fputc('"', file);
+}
 
-	// We determine the type of saving whether there is a next word after the
-	// file path. If there is not, we save as binary. If there is, and that word
-	// is "ascii", we save as text.
-	char *type = strtok(NULL, delim);
-	if (!type) {
-		save_binary(image, file_path);
+int stats_open(void)
+{
+	// Starts the trace. It is a JSON array of events in the Chrome trace
+	// format, which trace viewers can read even without its closing "]", so
+	// the events written before a crash are not lost.
+	stats.start = clock_seconds(CLOCK_MONOTONIC);
+	if (!options.trace)
+		return 1;
+	stats.trace = fopen(options.trace, "w");
+	if (!stats.trace) {
+		fprintf(stderr, "Failed to open %s\n", options.trace);
+		return 0;
+	}
+	fprintf(stats.trace, "[\n{\"name\": \"process_name\", \"ph\": \"M\", "
+			"\"pid\": %d, \"tid\": 1, \"args\": {\"name\": "
+			"\"image_editor\"}}", (int)getpid());
+	return 1;
+}
+
+void stats_close(void)
+{
+	if (!stats.trace)
 		return;
+	fprintf(stats.trace, "\n]\n");
+	fclose(stats.trace);
+	stats.trace = NULL;
+}
+
+void read_counters(counters_struct *now)
+{
+	// The loader thread (see PREFETCH) adds to "allocated" under the lock of
+	// the spares, and the writer thread counts its bytes apart.
+	writer_collect();
+	pthread_mutex_lock(&spares.lock);
+	*now = counters;
+	pthread_mutex_unlock(&spares.lock);
+}
+
+void stats_begin(usage_struct *usage)
+{
+	// Takes the values that stats_end subtracts.
+	read_counters(&usage->counters);
+	usage->cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+	usage->wall = clock_seconds(CLOCK_MONOTONIC);
+}
+
+void trace_event(usage_struct *usage, double start, const char *name,
+				 const char *file)
+{
+	// A complete event ("X") for the command, then a counter event ("C") for
+	// the memory, both in microseconds.
+	FILE *trace = stats.trace;
+	counters_struct now;
+	read_counters(&now);
+	int pid = (int)getpid();
+	double ts = (start - stats.start) * 1e6;
+	fprintf(trace, ",\n{\"name\": ");
+	trace_string(trace, name);
+	fprintf(trace, ", \"cat\": \"command\", \"ph\": \"X\", \"ts\": %.3f, "
+			"\"dur\": %.3f, \"pid\": %d, \"tid\": 1, \"args\": {",
+			ts, usage->wall * 1e6, pid);
+	if (file) {
+		fprintf(trace, "\"file\": ");
+		trace_string(trace, file);
+		fprintf(trace, ", ");
 	}
-	if (strcmp(type, "ascii") == 0)
-		save_text(image, file_path);
+	fprintf(trace, "\"cpu_ms\": %.3f, \"bytes_read\": %lld, "
+			"\"bytes_written\": %lld, \"pixels\": %lld, "
+			"\"bytes_allocated\": %lld, \"peak_rss_kb\": %ld}}",
+			usage->cpu * 1e3, usage->counters.read, usage->counters.written,
+			usage->counters.pixels, usage->counters.allocated,
+			usage->peak_rss);
+	fprintf(trace, ",\n{\"name\": \"memory\", \"ph\": \"C\", "
+			"\"ts\": %.3f, \"pid\": %d, \"args\": {\"peak_rss_mb\": %.3f, "
+			"\"allocated_mb\": %.3f}}",
+			(start - stats.start + usage->wall) * 1e6, pid,
+			usage->peak_rss / 1024.0, now.allocated / 1e6);
+	stats.nr_events++;
 }
 
-//=======================
-// EDITING FUNCTIONS
-//=======================
+void stats_end(usage_struct *usage, int opcode, const char *name,
+			   const char *file)
+{
+	// Turns the values taken by stats_begin into what the command used and
+	// adds it to the totals of the command.
+	double end = clock_seconds(CLOCK_MONOTONIC);
+	double start = usage->wall;
+	usage->cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - usage->cpu;
+	usage->wall = end - start;
+	counters_struct now;
+	read_counters(&now);
+	usage->counters.read = now.read - usage->counters.read;
+	usage->counters.written = now.written - usage->counters.written;
+	usage->counters.pixels = now.pixels - usage->counters.pixels;
+	usage->counters.allocated = now.allocated - usage->counters.allocated;
+	usage->peak_rss = peak_rss();
+
+	usage_struct *total = &stats.totals[opcode];
+	stats.names[opcode] = name;
+	stats.nr_runs[opcode]++;
+	total->wall += usage->wall;
+	total->cpu += usage->cpu;
+	total->counters.read += usage->counters.read;
+	total->counters.written += usage->counters.written;
+	total->counters.pixels += usage->counters.pixels;
+	total->counters.allocated += usage->counters.allocated;
+	total->peak_rss = usage->peak_rss;
+	if (stats.trace)
+		trace_event(usage, start, name, file);
+}
+
+void print_usage(const char *name, int nr_runs, usage_struct *usage)
+{
+	printf("%-10s %6d %11.3f %11.3f %9.1f %9.1f %9.2f %9.1f\n", name,
+		   nr_runs, usage->wall * 1e3, usage->cpu * 1e3,
+		   usage->counters.read / 1e6, usage->counters.written / 1e6,
+		   usage->counters.pixels / 1e6, usage->counters.allocated / 1e6);
+}
 
-image_struct *crop(image_struct *initial, int loaded_img_now, char *delim)
+void show_stats(instr_struct *instr)
 {
-	if (strtok(NULL, delim)) {	// CROP has no other parameter
+	// STATS prints the totals of every command run until now, in the order
+	// of the commands.
+	if (instr->invalid) {  // STATS has no parameter
 		printf("Invalid command\n");
-		return initial;
+		return;
 	}
-	if (loaded_img_now == 0) {
-		printf("No image loaded\n");
-		return initial;
+	if (!options.stats) {
+		printf("No statistics, run with --stats\n");
+		return;
+	}
+	printf("%-10s %6s %11s %11s %9s %9s %9s %9s\n", "command", "runs",
+		   "wall ms", "cpu ms", "read MB", "write MB", "Mpixels",
+		   "alloc MB");
+	usage_struct all;
+	memset(&all, 0, sizeof(all));
+	int nr_runs = 0;
+	for (int k = 0; k < NMAX_COMMANDS; k++) {
+		usage_struct *total = &stats.totals[k];
+		if (stats.nr_runs[k] == 0)
+			continue;
+		print_usage(stats.names[k], stats.nr_runs[k], total);
+		nr_runs += stats.nr_runs[k];
+		all.wall += total->wall;
+		all.cpu += total->cpu;
+		all.counters.read += total->counters.read;
+		all.counters.written += total->counters.written;
+		all.counters.pixels += total->counters.pixels;
+		all.counters.allocated += total->counters.allocated;
 	}
+	print_usage("total", nr_runs, &all);
+	printf("Peak RSS: %.1f MB\n", peak_rss() / 1024.0);
+	pthread_mutex_lock(&spares.lock);
+	printf("Buffer pool: %lld reused, %lld allocated, %.1f MB kept, "
+		   "%.1f MB released\n", spares.hits, spares.misses,
+		   spares.kept / 1e6, spares.released / 1e6);
+	pthread_mutex_unlock(&spares.lock);
+	printf("Image cache: %lld hits, %lld misses, %d images, %.1f MB kept\n",
+		   cache.hits, cache.misses, cache.nr_entries, cache.bytes / 1e6);
+}
 
-	image_struct *result;
-	if (image_alloc(&result) == 0)
-		return NULL;
+// ===========================
+// COMMAND SCRIPTS
+// ===========================
 
-	strcpy(result->image_type, initial->image_type);
-	result->max_value = initial->max_value;
+// An image loaded with a name (LOAD file AS name), with the APPLY commands
+// waiting for it and its own history, which are put back in "pending" and
+// "history" when it is used again (USE name).
+struct handle_struct {
+	char *name;	 // NULL for the image loaded without a name
+	image_struct *image;  // NULL if there is none
+	pending_struct pending;
+	history_struct history;
+};
 
-	select_struct *select = initial->select;
-	result->height = select->y2 - select->y1;
-	result->width = select->x2 - select->x1;
+typedef struct handle_struct handle_struct;
 
-	if (pixel_alloc(&result->pixel, result->height, result->width) == 0)
-		return NULL;
+// What the commands work on. Once a name is used, every image is kept in
+// "handles", and handles[current] is the one in use, whose image is "image".
+struct editor_struct {
+	image_struct *image;
+	int loaded_img_now;	 // to keep track whether there is a loaded image
+	int stop;			 // EXIT ended the program
+	char *out_path;		 // where SAVE writes without a file (--batch)
+	handle_struct *handles;
+	int nr_handles, size_handles;
+	int current;
+};
 
-	for (int i = 0; i < result->height; i++) {
-		for (int j = 0; j < result->width; j++) {
-			result->pixel[i][j] =
-				initial->pixel[select->y1 + i][select->x1 + j];
-		}
-	}
+typedef struct editor_struct editor_struct;
 
-	if (select_alloc(&result->select) == 0)
-		return NULL;
-	result->select->x1 = 0;
-	result->select->x2 = result->width;
-	result->select->y1 = 0;
-	result->select->y2 = result->height;
+// The command lines parsed before they are run.
+struct program_struct {
+	instr_struct *instrs;
+	int nr_instrs, size;
+	words_struct words;	 // reused for every line
+};
 
-	printf("Image cropped\n");
-	free_img(initial);
-	return result;
-}
+typedef struct program_struct program_struct;
+
+// Every command is parsed once by "compile" and can then be run any number of
+// times by "run". The problems found by "compile" are only printed by "run",
+// in the same order as if the line was read at that moment.
+struct command_struct {
+	const char *name;
+	void (*compile)(instr_struct *instr, words_struct *words);
+	void (*run)(editor_struct *editor, instr_struct *instr);
+	int uses_image;	 // it needs the pixels or the history left before it
+};
+
+typedef struct command_struct command_struct;
 
-void histogram(image_struct *image, int loaded_img_now, char *delim)
+void compile_path(instr_struct *instr, words_struct *words)
 {
-	if (loaded_img_now == 0) {
-		printf("No image loaded\n");
+	// LOAD file, maybe followed by AS name: without a file, LOAD says the
+	// command is invalid.
+	char *word = next_word(words);
+	if (word && !(instr->path = strdup(word)))
+		fprintf(stderr, "strdup() for path failed\n");
+	word = next_word(words);
+	if (!word || strcmp(word, "AS") != 0)
 		return;
-	}
+	word = next_word(words);
+	if (!word)
+		instr->invalid = 1;
+	else if (!(instr->name = strdup(word)))
+		fprintf(stderr, "strdup() for name failed\n");
+}
 
-	// Determine the next elements in line
-	char *parameter = strtok(NULL, delim);
-	if (!parameter) {
-		printf("Invalid command\n");
+void compile_name(instr_struct *instr, words_struct *words)
+{
+	// USE name, or USE alone.
+	char *word = next_word(words);
+	if (word && !(instr->name = strdup(word)))
+		fprintf(stderr, "strdup() for name failed\n");
+	if (next_word(words))
+		instr->invalid = 1;
+}
+
+void compile_select(instr_struct *instr, words_struct *words)
+{
+	// SELECT ALL or SELECT x1 y1 x2 y2.
+	char *word = next_word(words);
+	if (!word) {
+		instr->invalid = 1;
 		return;
 	}
-	int max_stars = atoi(parameter);
-
-	parameter = strtok(NULL, delim);
-	if (!parameter) {
-		printf("Invalid command\n");
+	if (strcmp(word, "ALL") == 0) {
+		instr->flag = 1;
 		return;
 	}
-	int bins_nr = atoi(parameter);
+	instr->args[0] = atoi(word);
+	for (int i = 1; i < 4; i++) {	// We need 4 numbers (x1, y1, x2, y2)
+		word = next_word(words);
+		if (!word) {
+			instr->invalid = 1;
+			return;
+		}
+		for (int k = 0; word[k]; k++)
+			if (isalpha(word[k]) != 0) {  // verify they are not letters
+				instr->invalid = 1;
+				return;
+			}
+		instr->args[i] = atoi(word);
+	}
+}
 
-	parameter = strtok(NULL, delim);
-	if (parameter) {  // HISTOGRAM needs only 2 parameters
-		printf("Invalid command\n");
-		return;
+void compile_histogram(instr_struct *instr, words_struct *words)
+{
+	// HISTOGRAM stars bins, then maybe SELECTION.
+	for (int i = 0; i < 2; i++) {
+		char *word = next_word(words);
+		if (!word) {
+			instr->invalid = 1;
+			return;
+		}
+		instr->args[i] = atoi(word);
 	}
+	char *word = next_word(words);
+	if (word && strcmp(word, "SELECTION") == 0) {
+		instr->flag = 1;
+		word = next_word(words);
+	}
+	if (word || instr->args[1] <= 0)
+		instr->invalid = 1;
+}
 
-	if (strcmp(image->image_type, "P3") == 0 ||
-		strcmp(image->image_type, "P6") == 0) {
-		printf("Black and white image needed\n");
-		return;
+void compile_selection(instr_struct *instr, words_struct *words)
+{
+	// EQUALIZE, maybe followed by SELECTION.
+	char *word = next_word(words);
+	if (word && strcmp(word, "SELECTION") == 0) {
+		instr->flag = 1;
+		word = next_word(words);
 	}
+	if (word)
+		instr->invalid = 1;
+}
 
-	int *array_freq_bins;
-	if (array_alloc(&array_freq_bins, bins_nr) == 0)
-		return;
-	for (int i = 0; i < bins_nr; i++)
-		array_freq_bins[i] = 0;
+void compile_nothing(instr_struct *instr, words_struct *words)
+{
+	// CROP, UNDO, REDO, HISTORY and STATS have no parameter.
+	if (next_word(words))
+		instr->invalid = 1;
+}
 
-	// We determine how many pixel values are included in an interval of numbers
-	// that create a bin. We need to store it as a double to keep in mind if the
-	// total number of values is not divisible by the number of bins.
-	double interval = (double)(image->max_value + 1) / bins_nr;
+void compile_ignore(instr_struct *instr, words_struct *words)
+{
+	// EXIT doesn't look at the rest of the line.
+	(void)instr;
+	(void)words;
+}
+
+void compile_apply(instr_struct *instr, words_struct *words)
+{
+	// APPLY can have more parameters (APPLY BLUR SHARPEN EDGE), which are
+	// applied one after the other, as if they were separate commands. A large
+	// kernel (BOX_BLUR r, GAUSSIAN r or CUSTOM n with n other than 3) has to
+	// be the only one. "invalid" is 1 for "Invalid command" and 2 for "APPLY
+	// parameter invalid".
+	static const char *const big_types[] = {"CUSTOM", "BOX_BLUR", "GAUSSIAN"};
+	op_struct *op = (op_struct *)malloc(sizeof(op_struct));
+	if (!op) {
+		fprintf(stderr, "malloc() for op failed\n");
+		instr->invalid = 1;
+		return;
+	}
+	op->refs = 1;
+	op->done = 0;
+	op->tiles = NULL;
+	op->lost = 0;
+	op->failed = 0;
+	op->text[0] = '\0';
+	int nr_stages = 0, is_big = 0;
+	char *apply_type;
+	while ((apply_type = next_word(words))) {
+		if (nr_stages == NMAX_STAGES) {
+			instr->invalid = 1;
+			free(op);
+			return;
+		}
 
-	for (int i = 0; i < image->height; i++) {
-		for (int j = 0; j < image->width; j++) {
-			// We determine in which bin is the pixel found by dividing to the
-			// interval and approximating the value to the closest lower
-			// integer. We will have a result of {0, 1, 2,..., bins_nr - 1}.
-			double pos_bin_d = (double)image->pixel[i][j].grayscale / interval;
-			int pos_bin = floor(pos_bin_d);
+		int big_type = -1;
+		for (int t = 0; t < 3; t++)
+			if (strcmp(apply_type, big_types[t]) == 0)
+				big_type = t;
+		if (big_type >= 0) {
+			int parsed = parse_big_kernel(apply_type, words, &op->big,
+										  op->custom[nr_stages], &is_big);
+			if (parsed <= 0) {
+				instr->invalid = parsed < 0 ? 1 : 2;
+				free(op);
+				return;
+			}
+			op->names[nr_stages] = big_types[big_type];
+			if (is_big) {
+				if (nr_stages > 0 || next_word(words)) {
+					free_big_kernel(&op->big);
+					instr->invalid = 2;
+					free(op);
+					return;
+				}
+				sprintf(op->text, "%s %dx%d", apply_type, op->big.size,
+						op->big.size);
+				break;
+			}
+			make_stage(&op->stages[nr_stages], op->custom[nr_stages],
+					   options.isa);
+			nr_stages++;
+			continue;
+		}
 
-			// Increase the number of elements in the frequenct array.
-			array_freq_bins[pos_bin]++;
+		// We look for the kernel matrix of the type.
+		const named_kernel_struct *kernel = find_kernel(apply_type);
+		if (!kernel) {
+			instr->invalid = 2;
+			free(op);
+			return;
 		}
+		op->names[nr_stages] = kernel->name;
+		make_stage(&op->stages[nr_stages], kernel->mat, options.isa);
+		nr_stages++;
+	}
+	if (nr_stages == 0 && !is_big) {  // We need to have a parameter.
+		instr->invalid = 1;
+		free(op);
+		return;
+	}
+	op->nr_stages = nr_stages;
+	for (int k = 0; k < nr_stages; k++) {
+		if (k > 0)
+			strcat(op->text, " ");
+		strcat(op->text, op->names[k]);
 	}
+	instr->op = op;
+}
 
-	// Determine the maximum value in the frequency array.
-	int max_freq = 0;
-	for (int i = 0; i < bins_nr; i++)
-		if (array_freq_bins[i] > max_freq)
-			max_freq = array_freq_bins[i];
+void compile_save(instr_struct *instr, words_struct *words)
+{
+	// SAVE file, then maybe ascii or qoi: "flag" is 0 for binary, 1 for
+	// ascii, 3 for qoi and 2 for another word (nothing is saved).
+	char *word = next_word(words);
+	if (word && !(instr->path = strdup(word)))
+		fprintf(stderr, "strdup() for path failed\n");
+	word = next_word(words);
+	if (word && strcmp(word, "ascii") == 0)
+		instr->flag = 1;
+	else if (word)
+		instr->flag = strcmp(word, "qoi") == 0 ? 3 : 2;
+}
 
-	// For each bin, we determine the number of stars and print the result
-	// accordingly.
-	for (int i = 0; i < bins_nr; i++) {
-		int nr_stars = (array_freq_bins[i] * max_stars) / max_freq;
-		printf("%d\t|\t", nr_stars);
-		for (int j = 0; j < nr_stars; j++)
-			printf("*");
-		printf("\n");
-	}
+void compile_angle(instr_struct *instr, words_struct *words)
+{
+	// ROTATE angle.
+	char *word = next_word(words);
+	if (!word)
+		instr->invalid = 1;
+	else
+		instr->args[0] = atoi(word);
+}
 
-	free(array_freq_bins);
+void compile_threads(instr_struct *instr, words_struct *words)
+{
+	// THREADS N, with N > 0.
+	char *word = next_word(words);
+	if (!word || atoi(word) <= 0 || next_word(words))
+		instr->invalid = 1;
+	else
+		instr->args[0] = atoi(word);
 }
 
-double clamp(double nr, int min, int max)
+int find_handle(editor_struct *editor, char *name)
 {
-	// Make sure "nr" doesn't exceed the limits "min" or "max".
-	if (nr < min)
-		return min;
-	if (nr > max)
-		return max;
-	return nr;
+	for (int k = 0; k < editor->nr_handles; k++) {
+		char *other = editor->handles[k].name;
+		if ((!name && !other) || (name && other && strcmp(name, other) == 0))
+			return k;
+	}
+	return -1;
 }
 
-void equalize(image_struct *image, int loaded_img_now, char *delim)
+int add_handle(editor_struct *editor, char *name)
 {
-	if (loaded_img_now == 0) {
-		printf("No image loaded\n");
-		return;
+	// Returns the position of a new handle without an image, or -1.
+	if (editor->nr_handles == editor->size_handles) {
+		int size = editor->size_handles ? 2 * editor->size_handles : 8;
+		handle_struct *aux = (handle_struct *)realloc(editor->handles, size *
+													  sizeof(handle_struct));
+		if (!aux) {
+			fprintf(stderr, "realloc() for handles failed\n");
+			return -1;
+		}
+		editor->handles = aux;
+		editor->size_handles = size;
+	}
+	handle_struct *handle = &editor->handles[editor->nr_handles];
+	memset(handle, 0, sizeof(handle_struct));
+	if (name && !(handle->name = strdup(name))) {
+		fprintf(stderr, "strdup() for handle failed\n");
+		return -1;
 	}
+	return editor->nr_handles++;
+}
 
-	char *rest_line = strtok(NULL, delim);
-	if (rest_line) {  // EQUALIZE has no parameter
-		printf("Invalid command\n");
-		return;
+int switch_image(editor_struct *editor, char *name, int create)
+{
+	// Puts the image in use away with what belongs to it and uses the one
+	// called name instead (a new one, without an image, if "create" is set).
+	// Returns 0 if there is no such image.
+	if (editor->nr_handles == 0) {
+		if (add_handle(editor, NULL) < 0)
+			return 0;
+		editor->current = 0;
 	}
+	int k = find_handle(editor, name);
+	if (k < 0 && (!create || (k = add_handle(editor, name)) < 0))
+		return 0;
+	if (k == editor->current)
+		return 1;
 
-	if (strcmp(image->image_type, "P3") == 0 ||
-		strcmp(image->image_type, "P6") == 0) {
-		printf("Black and white image needed\n");
-		return;
+	handle_struct *handle = &editor->handles[editor->current];
+	handle->image = editor->loaded_img_now ? editor->image : NULL;
+	handle->pending = pending;
+	handle->history = history;
+	handle = &editor->handles[k];
+	editor->image = handle->image;
+	editor->loaded_img_now = handle->image != NULL;
+	pending = handle->pending;
+	history = handle->history;
+	editor->current = k;
+	return 1;
+}
+
+void free_handles(editor_struct *editor)
+{
+	// Frees the images that are not in use, with what belongs to them.
+	pending_struct in_use = pending;
+	history_struct in_use_history = history;
+	for (int k = 0; k < editor->nr_handles; k++) {
+		handle_struct *handle = &editor->handles[k];
+		if (k != editor->current) {
+			pending = handle->pending;
+			drop_pending("EXIT");
+			history = handle->history;
+			history_clear();
+			free(history.undo);
+			free(history.redo);
+			if (handle->image)
+				free_img(handle->image);
+		}
+		free(handle->name);
 	}
+	pending = in_use;
+	history = in_use_history;
+	free(editor->handles);
+	editor->handles = NULL;
+	editor->nr_handles = editor->size_handles = 0;
+}
 
-	int area = image->height * image->width;
+int forget_file(editor_struct *editor, char *file_path)
+{
+	// SAVE is about to write over file_path: the images put away, the images
+	// kept by the histories and the cache stop using its mapping. The image
+	// in use is left to save. Returns 0 if one of them could not get a copy
+	// of its own, and then the file must be left as it is.
+	struct stat st;
+	if (!file_path || stat(file_path, &st) != 0)
+		return 1;
+	if (history_forget(&history, &st) == 0)
+		return 0;
+	for (int k = 0; k < editor->nr_handles; k++) {
+		image_struct *image = editor->handles[k].image;
+		if (k == editor->current)
+			continue;
+		if (history_forget(&editor->handles[k].history, &st) == 0)
+			return 0;
+		if (!image)
+			continue;
+		mapping_struct *mapping = image->buffer->mapping;
+		if (mapping && mapping->dev == st.st_dev &&
+			mapping->ino == st.st_ino && own_data(image) == 0)
+			return 0;
+	}
+	cache_forget(&st);
+	loader_forget(&st);
+	return 1;
+}
 
-	// We determine how many pixels of the same value exist with a frequency
-	// array.
-	int *array_freq_pixels;
-	if (array_alloc(&array_freq_pixels, (image->max_value + 1)) == 0)
+void run_load(editor_struct *editor, instr_struct *instr)
+{
+	// LOAD file AS name loads the image next to the others, and uses it.
+	if (instr->invalid) {
+		printf("Invalid command\n");
 		return;
-	for (int i = 0; i <= image->max_value; i++)
-		array_freq_pixels[i] = 0;
-
-	for (int i = 0; i < image->height; i++) {
-		for (int j = 0; j < image->width; j++) {
-			int c = image->pixel[i][j].grayscale;
-			array_freq_pixels[c]++;
-		}
 	}
-
-	int *new_values;
-	if (array_alloc(&new_values, (image->max_value + 1)) == 0)
+	if (instr->name && switch_image(editor, instr->name, 1) == 0)
 		return;
+	drop_pending("LOAD");
+	history_clear();
+	if (writer_has_file(instr->path))
+		writer_wait();
+	writer_report();
+	editor->image = cache_load(editor->image, &editor->loaded_img_now, instr);
+}
 
-	for (int i = 0; i <= image->max_value; i++) {
-		// For each value of a pixel, we calculate the sum of appearances of
-		// pixels with values lower or equal with that pixel.
-		int partial_sum_freq = 0;
-		for (int j = 0; j <= i; j++)
-			partial_sum_freq += array_freq_pixels[j];
-
-		// We calculate the new value of the pixel with the formula provided in
-		// the documentation.
-		double new_val =
-			(double)image->max_value * (double)partial_sum_freq / (double)area;
-		new_values[i] = round(clamp(new_val, 0, image->max_value));
+void run_use(editor_struct *editor, instr_struct *instr)
+{
+	// USE name uses the image loaded as name, USE alone the one loaded
+	// without a name.
+	if (instr->invalid) {
+		printf("Invalid command\n");
+		return;
 	}
-
-	// We replace the old values with the new ones.
-	for (int i = 0; i < image->height; i++) {
-		for (int j = 0; j < image->width; j++) {
-			image->pixel[i][j].grayscale =
-				new_values[image->pixel[i][j].grayscale];
-		}
+	if (switch_image(editor, instr->name, 0) == 0) {
+		printf("No image named %s\n", instr->name);
+		return;
 	}
+	if (instr->name)
+		printf("Using %s\n", instr->name);
+	else
+		printf("Using the image without a name\n");
+}
 
-	free(array_freq_pixels);
-	free(new_values);
-	printf("Equalize done\n");
+void run_select(editor_struct *editor, instr_struct *instr)
+{
+	select_image(editor->image, editor->loaded_img_now, instr);
 }
 
-int border_kernel_min(int number)
+void run_histogram(editor_struct *editor, instr_struct *instr)
 {
-	// Determines the starting coordinate from which the kernel should be
-	// applied.
-	// Because we have a 3x3 matrix to apply on the image, we need a value
-	// greater than 0.
-	if (number > 0)
-		return number;
-	else
-		return 1;
+	if (editor->loaded_img_now)
+		run_pending(editor->image, "HISTOGRAM");
+	histogram(editor->image, editor->loaded_img_now, instr);
 }
 
-int border_kernel_max(int max_selected, int max_img)
+void run_equalize(editor_struct *editor, instr_struct *instr)
 {
-	// Determines the ending coordinate until which the kernel should be
-	// applied.
-	// Because we have a 3x3 matrix to apply on the image, we need a value
-	// lower than the height or width of the image.
-	if (max_selected < max_img)
-		return max_selected;
-	else
-		return (max_selected - 1);
+	if (editor->loaded_img_now)
+		run_pending(editor->image, "EQUALIZE");
+	equalize(editor->image, editor->loaded_img_now, instr);
 }
 
-image_struct *apply_kernel(image_struct *initial, double mat[][3],
-						   char *apply_type)
+void run_crop(editor_struct *editor, instr_struct *instr)
 {
-	if (strcmp(initial->image_type, "P2") == 0 ||
-		strcmp(initial->image_type, "P5") == 0) {
-		printf("Easy, Charlie Chaplin\n");
-		return initial;
-	}
+	editor->image = crop(editor->image, editor->loaded_img_now, instr);
+}
 
-	image_struct *result = copy_image(initial);
-	int i_min, i_max, j_min, j_max;
+void run_apply(editor_struct *editor, instr_struct *instr)
+{
+	editor->image = apply(editor->image, editor->loaded_img_now, instr);
+}
 
-	// We determine the starting and ending coordinates for the kernel
-	// application.
-	i_min = border_kernel_min(initial->select->y1);
-	j_min = border_kernel_min(initial->select->x1);
-	i_max = border_kernel_max(initial->select->y2, initial->height);
-	j_max = border_kernel_max(initial->select->x2, initial->width);
-
-	if (strcmp(initial->image_type, "P3") == 0 ||
-		strcmp(initial->image_type, "P6") == 0) {
-		// Because we have a 3x3 matrix and the element we calculate for is in
-		// its center, we have to start from [i - 1][j - 1] until [i + 1][j +
-		// 1].
-		for (int i_mat = i_min - 1; i_mat < i_max - 1; i_mat++) {
-			for (int j_mat = j_min - 1; j_mat < j_max - 1; j_mat++) {
-				double sumR = 0.0;
-				double sumG = 0.0;
-				double sumB = 0.0;
-				for (int i = 0; i < 3; i++) {
-					for (int j = 0; j < 3; j++) {
-						sumR += (double)mat[i][j] *
-								initial->pixel[i_mat + i][j_mat + j].r;
-						sumG += (double)mat[i][j] *
-								initial->pixel[i_mat + i][j_mat + j].g;
-						sumB += (double)mat[i][j] *
-								initial->pixel[i_mat + i][j_mat + j].b;
-					}
-				}
-				sumR = round(sumR);
-				sumG = round(sumG);
-				sumB = round(sumB);
-
-				// We have to make sure the calculated values are not
-				// negative or go beyond the maximum value.
-				result->pixel[i_mat + 1][j_mat + 1].r =
-					clamp(sumR, 0, initial->max_value);
-				result->pixel[i_mat + 1][j_mat + 1].g =
-					clamp(sumG, 0, initial->max_value);
-				result->pixel[i_mat + 1][j_mat + 1].b =
-					clamp(sumB, 0, initial->max_value);
-			}
-		}
+void run_save(editor_struct *editor, instr_struct *instr)
+{
+	char *file_path = instr->path ? instr->path : editor->out_path;
+	if (editor->loaded_img_now && forget_file(editor, file_path) == 0) {
+		printf("Failed to save %s\n", file_path);
+		return;
 	}
-
-	printf("APPLY %s done\n", apply_type);
-	free_img(initial);
-	return result;
+	if (editor->loaded_img_now && instr->stream && pending.nr_ops) {
+		save_stream(editor->image, editor->loaded_img_now, instr,
+					editor->out_path);
+		return;
+	}
+	if (editor->loaded_img_now)
+		run_pending(editor->image, "SAVE");
+	save(editor->image, editor->loaded_img_now, instr, editor->out_path);
 }
 
-image_struct *apply(image_struct *image, int loaded_img_now, char *delim)
+void run_exit(editor_struct *editor, instr_struct *instr)
 {
-	if (loaded_img_now == 0) {
-		printf("No image loaded\n");
-		return image;
-	}
-	char *apply_type = strtok(NULL, delim);
-	if (!apply_type) {	// We need to have a parameter.
-		printf("Invalid command\n");
-		return image;
+	(void)instr;
+	drop_pending("EXIT");
+	history_clear();
+	writer_wait();
+	loader_drop();
+	if (exit_program(editor->image, editor->loaded_img_now) == 1) {
+		editor->image = NULL;
+		editor->loaded_img_now = 0;
+		editor->stop = 1;
+		free_handles(editor);
 	}
+}
 
-	image_struct *result;
+void run_rotate(editor_struct *editor, instr_struct *instr)
+{
+	if (editor->loaded_img_now)
+		run_pending(editor->image, "ROTATE");
+	editor->image = rotate(editor->image, editor->loaded_img_now, instr);
+}
 
-	// For every type, we initialize the kernel matrix and apply it on the
-	// image.
-	if (strcmp(apply_type, "EDGE") == 0) {
-		double mat[3][3] = {{-1, -1, -1}, {-1, 8, -1}, {-1, -1, -1}};
-		result = apply_kernel(image, mat, apply_type);
-	} else {
-		if (strcmp(apply_type, "SHARPEN") == 0) {
-			double mat[3][3] = {{0, -1, 0}, {-1, 5, -1}, {0, -1, 0}};
-			result = apply_kernel(image, mat, apply_type);
-		} else {
-			if (strcmp(apply_type, "BLUR") == 0) {
-				double mat[3][3] = {{1.0 / 9, 1.0 / 9, 1.0 / 9},
-									{1.0 / 9, 1.0 / 9, 1.0 / 9},
-									{1.0 / 9, 1.0 / 9, 1.0 / 9}};
-				result = apply_kernel(image, mat, apply_type);
-			} else {
-				if (strcmp(apply_type, "GAUSSIAN_BLUR") == 0) {
-					double mat[3][3] = {{1.0 / 16, 2.0 / 16, 1.0 / 16},
-										{2.0 / 16, 4.0 / 16, 2.0 / 16},
-										{1.0 / 16, 2.0 / 16, 1.0 / 16}};
-					result = apply_kernel(image, mat, apply_type);
-				} else {
-					printf("APPLY parameter invalid\n");
-					return image;
-				}
-			}
-		}
-	}
-	return result;
+void run_threads(editor_struct *editor, instr_struct *instr)
+{
+	(void)editor;
+	set_threads(instr);
 }
 
-image_struct *full_rotation_90_back(image_struct *image)
+void run_undo(editor_struct *editor, instr_struct *instr)
 {
-	image_struct *result;
-	if (image_alloc(&result) == 0)
-		return NULL;
+	editor->image = undo(editor->image, editor->loaded_img_now, instr);
+}
 
-	strcpy(result->image_type, image->image_type);
-	result->height = image->width;	// We swap the height with the width.
-	result->width = image->height;
-	result->max_value = image->max_value;
+void run_redo(editor_struct *editor, instr_struct *instr)
+{
+	editor->image = redo(editor->image, editor->loaded_img_now, instr);
+}
 
-	if (pixel_alloc(&result->pixel, result->height, result->width) == 0)
-		return NULL;
-	if (select_alloc(&result->select) == 0)
-		return NULL;
-	result->select->x1 = image->select->x1;
-	result->select->y1 = image->select->y1;
-	result->select->x2 = image->select->y2;
-	result->select->y2 = image->select->x2;
+void run_history(editor_struct *editor, instr_struct *instr)
+{
+	show_history(editor->loaded_img_now, instr);
+}
 
-	// We go through the resulting matrix from the first column upward (which
-	// corresponds to the first line in the initial matrix from left to right)
-	// towards the last column of the matrix(which corresponds to the last line
-	// in the initial matrix).
-	int i_initial = 0;
-	for (int j = 0; j < result->width; j++) {
-		int j_initial = 0;
-		for (int i = result->height - 1; i >= 0; i--) {
-			result->pixel[i][j] = image->pixel[i_initial][j_initial];
-			j_initial++;
-		}
-		i_initial++;
-	}
+void run_stats(editor_struct *editor, instr_struct *instr)
+{
+	(void)editor;
+	show_stats(instr);
+}
 
-	free_img(image);
+// The opcodes are the positions in "commands".
+#define CMD_LOAD 0
+#define CMD_SAVE 6
+#define CMD_EXIT 7
+#define NR_COMMANDS 15
+
+#define SCRIPT_CHUNK 1024  // lines of a script compiled before they are run
+
+const command_struct commands[NR_COMMANDS] = {
+	{"LOAD", compile_path, run_load, 0},
+	{"SELECT", compile_select, run_select, 0},
+	{"HISTOGRAM", compile_histogram, run_histogram, 1},
+	{"EQUALIZE", compile_selection, run_equalize, 1},
+	{"CROP", compile_nothing, run_crop, 1},
+	{"APPLY", compile_apply, run_apply, 1},
+	{"SAVE", compile_save, run_save, 1},
+	{"EXIT", compile_ignore, run_exit, 0},
+	{"ROTATE", compile_angle, run_rotate, 1},
+	{"THREADS", compile_threads, run_threads, 0},
+	{"UNDO", compile_nothing, run_undo, 1},
+	{"REDO", compile_nothing, run_redo, 1},
+	{"HISTORY", compile_nothing, run_history, 1},
+	{"STATS", compile_nothing, run_stats, 0},
+	{"USE", compile_name, run_use, 1},
+};
 
-	return result;
+void init_program(program_struct *program)
+{
+	program->instrs = NULL;
+	program->nr_instrs = 0;
+	program->size = 0;
+	program->words.word = NULL;
+	program->words.size = 0;
 }
 
-image_struct *full_rotation_90(image_struct *image)
+void clear_program(program_struct *program)
 {
-	image_struct *result;
-	if (image_alloc(&result) == 0)
-		return NULL;
+	// Forgets the instructions, but keeps the memory for the next ones.
+	for (int k = 0; k < program->nr_instrs; k++) {
+		free(program->instrs[k].path);
+		free(program->instrs[k].name);
+		if (program->instrs[k].op)
+			free_op(program->instrs[k].op);
+	}
+	program->nr_instrs = 0;
+}
 
-	strcpy(result->image_type, image->image_type);
-	result->height = image->width;	// We swap the height with the width.
-	result->width = image->height;
-	result->max_value = image->max_value;
+void free_program(program_struct *program)
+{
+	clear_program(program);
+	free(program->instrs);
+	free(program->words.word);
+}
 
-	if (pixel_alloc(&result->pixel, result->height, result->width) == 0)
-		return NULL;
-	if (select_alloc(&result->select) == 0)
+instr_struct *compile_line(program_struct *program, char *line)
+{
+	// Adds the instruction of the line at the end of the program. Returns
+	// NULL for a line without words, which is not an instruction.
+	if (split_words(line, &program->words) == 0 ||
+		program->words.nr_words == 0)
 		return NULL;
-	result->select->x1 = image->select->x1;
-	result->select->y1 = image->select->y1;
-	result->select->x2 = image->select->y2;
-	result->select->y2 = image->select->x2;
-
-	// We go through the resulting matrix from the last column downward (which
-	// corresponds to the first line in the initial matrix from left to right)
-	// towards the first column of the matrix(which corresponds to the last line
-	// in the initial matrix).
-	int i_initial = 0;
-	for (int j = result->width - 1; j >= 0; j--) {
-		int j_initial = 0;
-		for (int i = 0; i < result->height; i++) {
-			result->pixel[i][j] = image->pixel[i_initial][j_initial];
-			j_initial++;
+	if (program->nr_instrs == program->size) {
+		int size = program->size ? 2 * program->size : 64;
+		instr_struct *aux = (instr_struct *)realloc(program->instrs, size *
+													sizeof(instr_struct));
+		if (!aux) {
+			fprintf(stderr, "realloc() for program failed\n");
+			return NULL;
 		}
-		i_initial++;
+		program->instrs = aux;
+		program->size = size;
 	}
+	instr_struct *instr = &program->instrs[program->nr_instrs++];
+	memset(instr, 0, sizeof(instr_struct));
+	instr->opcode = -1;
+	char *name = next_word(&program->words);
+	for (int k = 0; k < NR_COMMANDS; k++)
+		if (strcmp(name, commands[k].name) == 0) {
+			instr->opcode = k;
+			commands[k].compile(instr, &program->words);
+			break;
+		}
+	return instr;
+}
 
-	free_img(image);
+void mark_streams(program_struct *program, int last)
+{
+	// A SAVE can be streamed if the image is not used after it: the next
+	// command that uses it is a LOAD (without a name) or EXIT, or there is
+	// none and this is the "last" chunk of the script. We go from the last
+	// instruction to the first one.
+	int used = !last;
+	for (int k = program->nr_instrs - 1; k >= 0; k--) {
+		instr_struct *instr = &program->instrs[k];
+		if (instr->opcode < 0)
+			continue;
+		if ((instr->opcode == CMD_LOAD && !instr->name) ||
+			instr->opcode == CMD_EXIT)
+			used = 0;
+		if (instr->opcode == CMD_SAVE)
+			instr->stream = options.stream && !used;
+		if (commands[instr->opcode].uses_image)
+			used = 1;
+	}
+}
 
-	return result;
+void prefetch_next(program_struct *program, int k)
+{
+	// After the LOAD at k, the file of the next LOAD (if EXIT doesn't come
+	// first) is decoded while the commands between them are run. Not if it
+	// is in the cache, or written by a SAVE before that LOAD or still being
+	// written by one.
+	if (!options.prefetch)
+		return;
+	int next = k + 1;
+	while (next < program->nr_instrs &&
+		   program->instrs[next].opcode != CMD_LOAD) {
+		if (program->instrs[next].opcode == CMD_EXIT)
+			return;
+		next++;
+	}
+	if (next == program->nr_instrs)
+		return;
+	instr_struct *instr = &program->instrs[next];
+	struct stat st;
+	if (instr->invalid || !instr->path || stat(instr->path, &st) != 0 ||
+		writer_has_file(instr->path))
+		return;
+	for (int m = k + 1; m < next; m++)
+		if (program->instrs[m].opcode == CMD_SAVE &&
+			program->instrs[m].path &&
+			strcmp(program->instrs[m].path, instr->path) == 0)
+			return;
+	for (int c = 0; options.cache && c < cache.nr_entries; c++)
+		if (strcmp(cache.entries[c].path, instr->path) == 0 &&
+			same_file(&cache.entries[c].st, &st))
+			return;
+	loader_start(instr);
 }
 
-image_struct *select_rotation_90_back(image_struct *image)
+void run_program(editor_struct *editor, program_struct *program)
 {
-	image_struct *result = copy_image(image);
-	select_struct *select = image->select;
+	// The instructions are run one after the other, until EXIT. With
+	// --stats, every command is measured.
+	for (int k = 0; k < program->nr_instrs && !editor->stop; k++) {
+		instr_struct *instr = &program->instrs[k];
+		if (instr->opcode < 0) {
+			printf("Invalid command\n");
+		} else if (options.stats) {
+			usage_struct usage;
+			stats_begin(&usage);
+			commands[instr->opcode].run(editor, instr);
+			stats_end(&usage, instr->opcode, commands[instr->opcode].name,
+					  instr->path);
+		} else {
+			commands[instr->opcode].run(editor, instr);
+		}
+		if (instr->opcode == CMD_LOAD)
+			prefetch_next(program, k);
+	}
+}
 
-	int difference_x = select->x2 - select->x1;
-	int difference_y = select->y2 - select->y1;
+// ===========================
+// BATCH MODE
+// ===========================
 
-	// We copy the selected pixels in an auxiliary matrix
-	pixel_struct **pixel_aux;
-	if (pixel_alloc(&pixel_aux, difference_y, difference_x) == 0)
-		return NULL;
+// What a worker sends back for every input, followed by its messages.
+struct batch_result_struct {
+	int index;		  // in options.inputs
+	double seconds;	  // from LOAD to the end of the script
+	int loaded;		  // 0 if LOAD failed
+	size_t size;	  // bytes of messages
+};
 
-	for (int i = 0; i < difference_x; i++)
-		for (int j = 0; j < difference_y; j++)
-			pixel_aux[i][j] = image->pixel[select->y1 + i][select->x1 + j];
+typedef struct batch_result_struct batch_result_struct;
 
-	// We rotate the selected pixels in another auxiliary matrix.
-	pixel_struct **pixel_aux_res;
-	if (pixel_alloc(&pixel_aux_res, difference_y, difference_x) == 0)
-		return NULL;
+int read_full(int fd, void *data, size_t size)
+{
+	// Returns 0 if the pipe ends before "size" bytes.
+	while (size) {
+		ssize_t len = read(fd, data, size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return 0;
+		data = (char *)data + len;
+		size -= len;
+	}
+	return 1;
+}
 
-	for (int i = 0; i < difference_x; i++)
-		for (int j = 0; j < difference_y; j++)
-			pixel_aux_res[i][j] = pixel_aux[j][difference_x - 1 - i];
+int check_script(instr_struct *instr)
+{
+	// LOAD and the file name of SAVE come from the inputs, so a SAVE in a
+	// script only takes "ascii" or "qoi" (read as its file name by
+	// compile_save).
+	if (instr->opcode < 0 || instr->opcode == CMD_LOAD)
+		return 0;
+	if (instr->opcode != CMD_SAVE || !instr->path)
+		return 1;
+	if (instr->flag != 0)
+		return 0;
+	if (strcmp(instr->path, "ascii") == 0)
+		instr->flag = 1;
+	else if (strcmp(instr->path, "qoi") == 0)
+		instr->flag = 3;
+	else
+		return 0;
+	free(instr->path);
+	instr->path = NULL;
+	return 1;
+}
 
-	// We replace the selected pixels from the initial matrix with the new
-	// rotated ones.
-	int i_curent = 0;
-	for (int i = select->y1; i < select->y2; i++) {
-		int j_curent = 0;
-		for (int j = select->x1; j < select->x2; j++) {
-			result->pixel[i][j] = pixel_aux_res[i_curent][j_curent];
-			j_curent++;
+int read_script(program_struct *script, char *file_path)
+{
+	// The script is parsed and checked only once, before any input.
+	FILE *in = fopen(file_path, "r");
+	if (!in) {
+		fprintf(stderr, "Failed to open %s\n", file_path);
+		return 0;
+	}
+	char *line = NULL, *copy = NULL;
+	size_t size = 0;
+	int line_nr = 0, ok = 1;
+	init_program(script);
+	while (ok && getline(&line, &size, in) != -1) {
+		line_nr++;
+		free(copy);
+		copy = strdup(line);  // the words are cut in line
+		instr_struct *instr = compile_line(script, line);
+		if (instr && check_script(instr) == 0) {
+			fprintf(stderr, "%s:%d: invalid in a script: %s", file_path,
+					line_nr, copy ? copy : "\n");
+			ok = 0;
 		}
-		i_curent++;
 	}
-
-	free_img(image);
-	free_pixel(pixel_aux, difference_y);
-	free_pixel(pixel_aux_res, difference_y);
-
-	return result;
+	free(copy);
+	free(line);
+	fclose(in);
+	if (!ok)
+		free_program(script);
+	else
+		mark_streams(script, 1);
+	return ok;
 }
 
-image_struct *select_rotation_90(image_struct *image)
+int run_script(program_struct *script, char *input)
 {
-	image_struct *result = copy_image(image);
-	select_struct *select = result->select;
-
-	int difference_x = select->x2 - select->x1;
-	int difference_y = select->y2 - select->y1;
-
-	// We copy the selected pixels in an auxiliary matrix
-	pixel_struct **pixel_aux;
-	if (pixel_alloc(&pixel_aux, difference_y, difference_x) == 0)
-		return NULL;
-
-	for (int i = 0; i < difference_x; i++)
-		for (int j = 0; j < difference_y; j++)
-			pixel_aux[i][j] = image->pixel[select->y1 + i][select->x1 + j];
-
-	// We rotate the selected pixels in another auxiliary matrix.
-	pixel_struct **pixel_aux_res;
-	if (pixel_alloc(&pixel_aux_res, difference_y, difference_x) == 0)
-		return NULL;
-
-	for (int i = 0; i < difference_x; i++)
-		for (int j = 0; j < difference_y; j++)
-			pixel_aux_res[i][j] = pixel_aux[difference_x - 1 - j][i];
-
-	// We replace the selected pixels from the initial matrix with the new
-	// rotated ones.
-	int i_curent = 0;
-	for (int i = select->y1; i < select->y2; i++) {
-		int j_curent = 0;
-		for (int j = select->x1; j < select->x2; j++) {
-			result->pixel[i][j] = pixel_aux_res[i_curent][j_curent];
-			j_curent++;
+	// LOAD input, then the script, with SAVE writing to out_dir under the
+	// name of the input. Only this image is kept in memory. Returns 0 if the
+	// input could not be loaded.
+	char *name = strrchr(input, '/') ? strrchr(input, '/') + 1 : input;
+	editor_struct editor = {NULL, 0, 0, NULL, NULL, 0, 0, 0};
+	if (options.out_dir) {
+		editor.out_path = (char *)malloc(strlen(options.out_dir) +
+										 strlen(name) + 2);
+		if (!editor.out_path) {
+			fprintf(stderr, "malloc() for path failed\n");
+			return 0;
 		}
-		i_curent++;
+		sprintf(editor.out_path, "%s/%s", options.out_dir, name);
 	}
 
-	free_img(image);
-	free_pixel(pixel_aux, difference_y);
-	free_pixel(pixel_aux_res, difference_y);
-	return result;
+	instr_struct load;
+	memset(&load, 0, sizeof(load));
+	load.opcode = CMD_LOAD;
+	load.path = input;
+	commands[CMD_LOAD].run(&editor, &load);
+	int loaded = editor.loaded_img_now;
+	run_program(&editor, script);
+	writer_wait();
+
+	drop_pending("batch");
+	history_clear();
+	if (editor.loaded_img_now)
+		free_img(editor.image);
+	free_handles(&editor);
+	free(editor.out_path);
+	return loaded;
 }
 
-image_struct *rotate(image_struct *image, int loaded_img_now, char *delim)
+void batch_worker(program_struct *script, int task_fd, int result_fd)
 {
-	if (loaded_img_now == 0) {
-		printf("No image loaded\n");
-		return image;
+	// Runs the script on every input the parent sends, one at a time. What
+	// the commands print goes to a temporary file and is sent back with the
+	// time, so the messages of two inputs are never mixed.
+	FILE *messages = tmpfile();
+	if (!messages || dup2(fileno(messages), STDOUT_FILENO) < 0) {
+		fprintf(stderr, "tmpfile() for messages failed\n");
+		return;
 	}
-	char *elem = strtok(NULL, delim);  // Needs a parameter (the angle)
-	int rotation_nr = atoi(elem);
-
-	if (rotation_nr % 90 != 0) {
-		printf("Unsupported rotation angle\n");
-		return image;
+	int threads = options.threads / options.jobs;
+	pool_start(threads > 1 ? threads : 1);
+
+	int index;
+	while (read_full(task_fd, &index, sizeof(int))) {
+		double start = clock_seconds(CLOCK_MONOTONIC);
+		batch_result_struct result;
+		result.loaded = run_script(script, options.inputs[index]);
+		fflush(stdout);
+		result.index = index;
+		result.seconds = clock_seconds(CLOCK_MONOTONIC) - start;
+		off_t size = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		result.size = size > 0 ? (size_t)size : 0;
+		char *text = (char *)malloc(result.size + 1);
+		if (!text || pread(STDOUT_FILENO, text, result.size, 0) !=
+					 (ssize_t)result.size)
+			result.size = 0;
+		int sent = write_all(result_fd, &result, sizeof(result)) &&
+				   write_all(result_fd, text, result.size);
+		free(text);
+		if (!sent)
+			break;
+		fseek(stdout, 0, SEEK_SET);
+		if (ftruncate(STDOUT_FILENO, 0) < 0)
+			break;
 	}
+	writer_stop();
+	pool_stop();
+}
 
-	select_struct *select = image->select;	// For easier use
-
-	// We verify if the whole image is selected.
-	if (select->x1 == 0 && select->y1 == 0 && select->x2 == image->width &&
-		select->y2 == image->height) {	// FULL ROTATION
-		if (rotation_nr == 0) {
-			printf("Rotated %d\n", rotation_nr);
-			return image;
+int start_worker(program_struct *script, int w, int *task_fds,
+				 int *result_fds)
+{
+	// Forks worker w, with a pipe for its inputs and one for its results.
+	// Returns its pid, or -1.
+	int task[2], result[2];
+	if (pipe(task) < 0)
+		return -1;
+	if (pipe(result) < 0) {
+		close(task[0]);
+		close(task[1]);
+		return -1;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		// The pipes of the other workers are closed, or they would never
+		// see the end of theirs.
+		for (int v = 0; v < w; v++) {
+			close(task_fds[v]);
+			close(result_fds[v]);
 		}
+		close(task[1]);
+		close(result[0]);
+		batch_worker(script, task[0], result[1]);
+		_exit(0);
+	}
+	close(task[0]);
+	close(result[1]);
+	if (pid < 0) {
+		close(task[1]);
+		close(result[0]);
+		return -1;
+	}
+	task_fds[w] = task[1];
+	result_fds[w] = result[0];
+	return (int)pid;
+}
 
-		image_struct *result;
-		int times = rotation_nr / 90;
-		if (times < 0) {  // NEGATIVE ANGLE
-			times = -times;
-			for (int k = 0; k < times; k++) {
-				result = full_rotation_90_back(image);
-				image = copy_image(result);
-				free_img(result);
-			}
-		} else {  // POSITIVE ANGLE
-			for (int k = 0; k < times; k++) {
-				result = full_rotation_90(image);
-				image = copy_image(result);
-				free_img(result);
+void give_input(int w, int *next, int *task_fds, int *current)
+{
+	// Sends worker w the next input, or closes its pipe when there is none.
+	current[w] = -1;
+	if (*next < options.nr_inputs &&
+		write_all(task_fds[w], next, sizeof(int))) {
+		current[w] = (*next)++;
+		return;
+	}
+	close(task_fds[w]);
+	task_fds[w] = -1;
+}
+
+int run_batch(void)
+{
+	// --batch: the script is run on every input by "jobs" worker processes.
+	// A worker only has one image at a time and takes the next input when it
+	// is done, so slow inputs don't hold the others back.
+	program_struct script;
+	if (read_script(&script, options.batch) == 0)
+		return 1;
+	if (!options.out_dir)
+		for (int k = 0; k < script.nr_instrs; k++)
+			if (script.instrs[k].opcode == CMD_SAVE) {
+				fprintf(stderr, "SAVE in a script needs --out-dir\n");
+				free_program(&script);
+				return 1;
 			}
+	if (options.out_dir && mkdir(options.out_dir, 0777) < 0 &&
+		errno != EEXIST) {
+		fprintf(stderr, "Failed to create %s\n", options.out_dir);
+		free_program(&script);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);	// a worker that died is reported instead
+
+	int jobs = options.jobs < options.nr_inputs ? options.jobs
+												 : options.nr_inputs;
+	int *fds = (int *)malloc(3 * (jobs + 1) * sizeof(int));
+	struct pollfd *polls = (struct pollfd *)malloc((jobs + 1) *
+												   sizeof(struct pollfd));
+	if (!fds || !polls) {
+		fprintf(stderr, "malloc() for workers failed\n");
+		free(fds);
+		free(polls);
+		free_program(&script);
+		return 1;
+	}
+	options.jobs = jobs;	// the threads are shared between them
+	int *task_fds = fds, *result_fds = fds + jobs + 1;
+	int *current = fds + 2 * (jobs + 1);
+
+	double start = clock_seconds(CLOCK_MONOTONIC);
+	int next = 0, alive = 0, done = 0, failed = 0;
+	for (int w = 0; w < jobs; w++) {
+		if (start_worker(&script, w, task_fds, result_fds) < 0) {
+			fprintf(stderr, "fork() for worker %d failed\n", w);
+			jobs = w;
+			break;
 		}
-		printf("Rotated %d\n", rotation_nr);
-		return image;
+		alive++;
 	}
-	if (select->x1 != 0 || select->y1 != 0 || select->x2 != image->width ||
-		select->y2 != image->height) {	// SELECTION ROTATION
-		if (select->x2 - select->x1 != select->y2 - select->y1) {
-			printf("The selection must be square\n");
-			return image;
+	for (int w = 0; w < jobs; w++)
+		give_input(w, &next, task_fds, current);
+	if (jobs == 0)
+		failed = options.nr_inputs;
+
+	while (alive) {
+		for (int w = 0; w < jobs; w++) {
+			polls[w].fd = result_fds[w];
+			polls[w].events = POLLIN;
 		}
-
-		image_struct *result;
-		int times = rotation_nr / 90;
-		if (times < 0) {  // NEGATIVE ANGLE
-			times = -times;
-			for (int k = 0; k < times; k++) {
-				result = select_rotation_90_back(image);
-				image = copy_image(result);
-				free_img(result);
-			}
-		} else {  // POSITIVE ANGLE
-			for (int k = 0; k < times; k++) {
-				result = select_rotation_90(image);
-				image = copy_image(result);
-				free_img(result);
+		if (poll(polls, jobs, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (int w = 0; w < jobs; w++) {
+			if (result_fds[w] < 0 || polls[w].revents == 0)
+				continue;
+			batch_result_struct result;
+			char *text = NULL;
+			if (read_full(result_fds[w], &result, sizeof(result)) == 0 ||
+				!(text = (char *)malloc(result.size + 1)) ||
+				read_full(result_fds[w], text, result.size) == 0) {
+				// The worker is gone: either it had nothing left to do, or it
+				// died while working on an input.
+				free(text);
+				if (current[w] >= 0) {
+					printf("== %s: the worker died\n",
+						   options.inputs[current[w]]);
+					failed++;
+				}
+				if (task_fds[w] >= 0)
+					close(task_fds[w]);
+				close(result_fds[w]);
+				task_fds[w] = result_fds[w] = -1;
+				alive--;
+				continue;
 			}
+			printf("== %s: %.3f ms%s\n", options.inputs[result.index],
+				   result.seconds * 1000, result.loaded ? "" : ", failed");
+			fwrite(text, 1, result.size, stdout);
+			free(text);
+			if (result.loaded)
+				done++;
+			else
+				failed++;
+			give_input(w, &next, task_fds, current);
 		}
 	}
-	printf("Rotated %d\n", rotation_nr);
-	return image;
+	while (wait(NULL) > 0)
+		;
+
+	// The inputs no worker could take are counted as failed.
+	failed += options.nr_inputs - done - failed;
+	double seconds = clock_seconds(CLOCK_MONOTONIC) - start;
+	printf("Batch: %d images in %.3f s, %.1f images/s with %d jobs",
+		   done, seconds, seconds > 0 ? done / seconds : 0.0, jobs);
+	if (failed)
+		printf(", %d failed", failed);
+	printf("\n");
+
+	free(fds);
+	free(polls);
+	free_program(&script);
+	return failed ? 1 : 0;
 }
 
-int exit_program(image_struct *image, int loaded_img_now)
+int parse_options(int argc, char *argv[])
 {
-	// If there is an image loaded, we deallocate its memory and return 1,
-	// so in main we will be able to verify it and end the program.
-	if (loaded_img_now == 0) {
-		printf("No image loaded\n");
+	// Reads the options given in the command line.
+	options.verbose = 0;
+	options.isa = detect_isa();
+	options.explain = 0;
+	options.history = 0;
+	options.look_ahead = 0;
+	options.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (options.threads < 1)
+		options.threads = 1;
+	options.batch = NULL;
+	options.spare = 64;
+	options.cache = 0;
+	options.stream = 1;
+	options.prefetch = 1;
+	options.write_behind = 1;
+	options.stats = 0;
+	options.trace = NULL;
+	options.jobs = options.threads;
+	options.out_dir = NULL;
+	options.nr_inputs = 0;
+	options.inputs = (char **)malloc(argc * sizeof(char *));
+	if (!options.inputs) {
+		fprintf(stderr, "malloc() for inputs failed\n");
+		return 0;
+	}
+	int usage = 0;
+	for (int i = 1; i < argc && !usage; i++) {
+		if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+			options.verbose = 1;
+		} else if (strcmp(argv[i], "--buffer-pool") == 0 && i + 1 < argc &&
+				   is_digit(argv[i + 1][0])) {
+			options.spare = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc &&
+				   is_digit(argv[i + 1][0])) {
+			options.cache = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--no-stream") == 0) {
+			options.stream = 0;
+		} else if (strcmp(argv[i], "--no-prefetch") == 0) {
+			options.prefetch = 0;
+		} else if (strcmp(argv[i], "--no-write-behind") == 0) {
+			options.write_behind = 0;
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			options.stats = 1;
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			options.trace = argv[++i];
+			options.stats = 1;
+		} else if (strcmp(argv[i], "--explain") == 0) {
+			options.explain = 1;
+		} else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc &&
+				   is_digit(argv[i + 1][0])) {
+			options.history = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--look-ahead") == 0) {
+			options.look_ahead = 1;
+		} else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc &&
+				   atoi(argv[i + 1]) > 0) {
+			options.threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc) {
+			// We can only go down from what the processor supports.
+			i++;
+			int isa = ISA_SCALAR;
+			if (strcmp(argv[i], "sse2") == 0)
+				isa = ISA_SSE2;
+			if (strcmp(argv[i], "avx2") == 0)
+				isa = ISA_AVX2;
+			if (isa < options.isa)
+				options.isa = isa;
+		} else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			options.batch = argv[++i];
+		} else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc &&
+				   atoi(argv[i + 1]) > 0) {
+			options.jobs = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--out-dir") == 0 && i + 1 < argc) {
+			options.out_dir = argv[++i];
+		} else if (argv[i][0] != '-') {
+			options.inputs[options.nr_inputs++] = argv[i];
+		} else {
+			usage = 1;
+		}
+	}
+	// The inputs only make sense with a script. The workers of a batch can't
+	// share a trace.
+	if (usage || (options.nr_inputs && !options.batch) ||
+		(options.trace && options.batch)) {
+		fprintf(stderr,
+				"Usage: %s [--verbose] [--threads N] "
+				"[--isa scalar|sse2|avx2] [--explain] "
+				"[--history MB] [--buffer-pool MB] [--cache MB] [--no-stream] "
+				"[--no-prefetch] [--no-write-behind] [--look-ahead] "
+				"[--stats] [--trace FILE]\n"
+				"       %s --batch SCRIPT [--jobs N] [--out-dir DIR] "
+				"INPUT...\n",
+				argv[0], argv[0]);
 		return 0;
 	}
-	free_img(image);
 	return 1;
 }
 
-int command_type(char *command)
+// The benchmarks (bench.c) include this file and have their own main.
+#ifndef BENCH
+int main(int argc, char *argv[])
 {
-	// Translate the commands into numbers so we will be able to use switch
-	// case.
-	if (strcmp(command, "LOAD") == 0)
-		return 1;
-	if (strcmp(command, "SELECT") == 0)
-		return 2;
-	if (strcmp(command, "HISTOGRAM") == 0)
-		return 3;
-	if (strcmp(command, "EQUALIZE") == 0)
-		return 4;
-	if (strcmp(command, "CROP") == 0)
-		return 5;
-	if (strcmp(command, "APPLY") == 0)
-		return 6;
-	if (strcmp(command, "SAVE") == 0)
-		return 7;
-	if (strcmp(command, "EXIT") == 0)
-		return 8;
-	if (strcmp(command, "ROTATE") == 0)
-		return 9;
-	return 0;
-}
+	editor_struct editor = {NULL, 0, 0, NULL, NULL, 0, 0, 0};
+	program_struct program;
+	char *line = NULL;
+	size_t size = 0;
 
-int main(void)
-{
-	char line[NMAX_LINE];
-	char *command;
-	char delim[] = "\n ";  // to separate the words on a line
-	image_struct *image;
-	int loaded_img_now = 0;	 // to keep track whether there is a loaded image
-
-	// We read the line on every loop. The program either stops with the
-	// "EXIT" command or when there are no more lines to read.
-	while (fgets(line, NMAX_LINE, stdin)) {
-		command = strtok(line, delim);
-		int type = command_type(command);
-		switch (type) {
-			case 1: {  // LOAD
-				image = load(image, &loaded_img_now, delim);
-				break;
-			}
-			case 2: {  // SELECT / SELECT ALL
-				select_image(image, loaded_img_now, delim);
-				break;
-			}
-			case 3: {  // HISTOGRAM
-				histogram(image, loaded_img_now, delim);
-				break;
-			}
-			case 4: {  // EQUALIZE
-				equalize(image, loaded_img_now, delim);
-				break;
-			}
-			case 5: {  // CROP
-				image = crop(image, loaded_img_now, delim);
-				break;
-			}
-			case 6: {  // APPLY
-				image = apply(image, loaded_img_now, delim);
-				break;
-			}
-			case 7: {  // SAVE
-				save(image, loaded_img_now, delim);
-				break;
-			}
-			case 8: {  // EXIT
-				if (exit_program(image, loaded_img_now) == 1)
-					return 0;
-				break;
-			}
-			case 9: {  // ROTATE
-				image = rotate(image, loaded_img_now, delim);
-				break;
-			}
-			default: {	// OTHER
-				printf("Invalid command\n");
-			}
+	if (parse_options(argc, argv) == 0)
+		return 1;
+	if (options.batch)
+		return run_batch();
+	pool_start(options.threads);
+
+	// The lines can be as long as needed. A script read from a file (or from
+	// a pipe with --look-ahead) is compiled in chunks of SCRIPT_CHUNK lines,
+	// and every chunk is run once it is read, so the commands can see the
+	// ones after them. Otherwise (a terminal or a pipe) every line is run as
+	// soon as it is read, and its answer is sent at once. A chunk also ends
+	// at "EXIT", which stops the reading, and the program ends with it or
+	// when there are no more lines.
+	struct stat st;
+	int look_ahead = options.look_ahead ||
+					 (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode));
+	if (stats_open() == 0) {
+		pool_stop();
+		return 1;
+	}
+	init_program(&program);
+	int more = 1;
+	while (!editor.stop && more) {
+		more = getline(&line, &size, stdin) != -1;
+		instr_struct *instr = more ? compile_line(&program, line) : NULL;
+		if (!more || !look_ahead || program.nr_instrs == SCRIPT_CHUNK ||
+			(instr && instr->opcode == CMD_EXIT)) {
+			mark_streams(&program, !more);
+			run_program(&editor, &program);
+			clear_program(&program);
+			// Whoever sends the lines one by one may wait for the answer.
+			if (!look_ahead)
+				fflush(stdout);
 		}
 	}
+	// Without an EXIT that freed them, the images are freed here.
+	if (!editor.stop) {
+		drop_pending("EXIT");
+		history_clear();
+		if (editor.loaded_img_now)
+			free_img(editor.image);
+		free_handles(&editor);
+	}
+	writer_stop();
+	loader_drop();
+	free(line);
+	free_program(&program);
+	cache_clear();
+	spare_free_all();
+	stats_close();
+	pool_stop();
 	return 0;
 }
+#endif
@@ -0,0 +1,241 @@
+#!/bin/sh
+# Runs scripts through the editor and checks what they print and save.
+# Usage: tests/regress.sh [path/to/image_editor]
+EDITOR=$(cd "$(dirname "${1:-./image_editor}")" && pwd)/$(basename "${1:-./image_editor}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+failed=0
+
+# A 4x3 P6 image with a different value in every sample.
+image()
+{
+	printf 'P6\n4 3\n255\n' > "$1"
+	i=0
+	while [ $i -lt 36 ]; do
+		printf "\\$(printf %o $((i * 7)))" >> "$1"
+		i=$((i + 1))
+	done
+}
+
+# ascii FILE TYPE WIDTH HEIGHT MAX_VALUE: a P2 or P3 image with samples
+# spread over all the values, written like SAVE ... ascii does.
+ascii()
+{
+	awk -v type="$2" -v w="$3" -v h="$4" -v max="$5" 'BEGIN {
+		n = w * (type == "P3" ? 3 : 1)
+		printf "%s\n%d %d\n%d\n", type, w, h, max
+		for (i = 0; i < h; i++)
+			for (j = 0; j < n; j++) {
+				k = i * n + j
+				printf "%d%s", (k * 7919 + k * k * 31) % (max + 1),
+					j < n - 1 ? " " : "\n"
+			}
+	}' > "$1"
+}
+
+check()
+{
+	# check NAME CONDITION...: prints the result of a case.
+	name=$1
+	shift
+	if "$@"; then
+		echo "ok   $name"
+	else
+		echo "FAIL $name"
+		failed=1
+	fi
+}
+
+image a.ppm
+cp a.ppm orig.ppm
+
+# A comment right after max_value is not pixels, but the samples that look
+# like whitespace or a "#" after the separator are.
+printf 'P6\n2 1\n255# made by hand\n\n #\1\2\3' > c.ppm
+printf 'LOAD c.ppm\nSAVE c.txt ascii\nEXIT\n' | "$EDITOR" > out.txt
+printf 'P3\n2 1\n255\n10 32 35 1 2 3\n' > expected.txt
+check "comment after max_value" cmp -s c.txt expected.txt
+
+# The size of a large kernel is a whole number, and 1x1 kernels are refused.
+printf 'LOAD a.ppm\nAPPLY BOX_BLUR 3x\nAPPLY GAUSSIAN 2.5\nAPPLY CUSTOM 1 1\nEXIT\n' |
+	"$EDITOR" | sed 1d > out.txt
+printf 'Invalid command\nInvalid command\nAPPLY parameter invalid\n' > expected.txt
+check "large kernel sizes" cmp -s out.txt expected.txt
+
+# The large kernels give the same pixels as the 3x3 ones, and as CUSTOM with
+# the same coefficients.
+ascii k.ppm P3 23 17 255
+kernel()
+{
+	# kernel OUTPUT APPLY...: saves k.ppm after the APPLY commands.
+	out=$1
+	shift
+	for apply in "$@"; do
+		echo "APPLY $apply"
+	done | { echo 'LOAD k.ppm'; cat; echo "SAVE $out ascii"; echo EXIT; } |
+		"$EDITOR" > /dev/null
+}
+kernel blur.txt BLUR
+kernel box1.txt 'BOX_BLUR 1'
+kernel custom3.txt 'CUSTOM 3 1/9 1/9 1/9 1/9 1/9 1/9 1/9 1/9 1/9'
+check "BOX_BLUR 1 is BLUR" cmp -s box1.txt blur.txt
+check "CUSTOM 3 is BLUR" cmp -s custom3.txt blur.txt
+kernel gaussian_blur.txt GAUSSIAN_BLUR
+kernel gaussian1.txt 'GAUSSIAN 1'
+check "GAUSSIAN 1 is GAUSSIAN_BLUR" cmp -s gaussian1.txt gaussian_blur.txt
+kernel box2.txt 'BOX_BLUR 2'
+kernel custom5.txt "CUSTOM 5$(printf ' 1/25%.0s' $(seq 25))"
+check "BOX_BLUR 2 is CUSTOM 5" cmp -s box2.txt custom5.txt
+kernel gaussian2.txt 'GAUSSIAN 2'
+kernel binomial.txt "CUSTOM 5 $(for i in 1 4 6 4 1; do
+	for j in 1 4 6 4 1; do
+		printf '%d/256 ' $((i * j))
+	done
+done)"
+check "GAUSSIAN 2 is CUSTOM 5" cmp -s gaussian2.txt binomial.txt
+
+# HISTOGRAM SELECTION counts the selected pixels only: the same as the
+# HISTOGRAM of the cropped image.
+ascii g.pgm P2 37 29 255
+printf 'LOAD g.pgm\nSELECT 5 3 30 20\nHISTOGRAM 10 8 SELECTION\nEXIT\n' |
+	"$EDITOR" | sed 1,2d > out.txt
+printf 'LOAD g.pgm\nSELECT 5 3 30 20\nCROP\nHISTOGRAM 10 8\nEXIT\n' |
+	"$EDITOR" | sed 1,3d > expected.txt
+check "histogram of a selection" cmp -s out.txt expected.txt
+
+# EQUALIZE SELECTION only changes the selection, with its own frequencies.
+printf 'LOAD g.pgm\nSELECT 5 3 30 20\nEQUALIZE SELECTION\nCROP\nSAVE o.pgm ascii\nEXIT\n' |
+	"$EDITOR" > /dev/null
+printf 'LOAD g.pgm\nSELECT 5 3 30 20\nCROP\nEQUALIZE\nSAVE e.pgm ascii\nEXIT\n' |
+	"$EDITOR" > /dev/null
+check "equalize a selection" cmp -s o.pgm e.pgm
+printf 'LOAD g.pgm\nSELECT 5 3 30 20\nEQUALIZE SELECTION\nSELECT 0 20 37 29\nCROP\nSAVE o.pgm ascii\nEXIT\n' |
+	"$EDITOR" > /dev/null
+printf 'LOAD g.pgm\nSELECT 0 20 37 29\nCROP\nSAVE e.pgm ascii\nEXIT\n' |
+	"$EDITOR" > /dev/null
+check "equalize a selection, outside of it" cmp -s o.pgm e.pgm
+
+# Samples of 16 bits come back the same, in binary and as text.
+ascii w.ppm P3 5 4 65535
+printf 'LOAD w.ppm\nSAVE w.bin\nLOAD w.bin\nSAVE w.txt ascii\nEXIT\n' |
+	"$EDITOR" > /dev/null
+check "16-bit round trip" cmp -s w.txt w.ppm
+check "16-bit binary samples" test "$(wc -c < w.bin)" -eq $((13 + 5 * 4 * 3 * 2))
+
+# UNDO goes back through every kind of edit, and REDO does them again.
+ascii u.ppm P3 40 30 255
+edits='SELECT 3 4 19 20\nAPPLY SHARPEN\nROTATE 90\nSELECT 5 5 30 25\nCROP\nROTATE -90\nAPPLY BLUR\n'
+printf "LOAD u.ppm\n${edits}SAVE done.ppm\nEXIT\n" | "$EDITOR" > /dev/null
+printf "LOAD u.ppm\n${edits}UNDO\nUNDO\nUNDO\nUNDO\nUNDO\nSAVE o1.ppm\nUNDO\nREDO\nREDO\nREDO\nREDO\nREDO\nSAVE o2.ppm\nREDO\nEXIT\n" |
+	"$EDITOR" --history 16 > out.txt
+printf 'LOAD u.ppm\nSAVE first.ppm\nEXIT\n' | "$EDITOR" > /dev/null
+check "undo every edit" cmp -s o1.ppm first.ppm
+check "redo every edit" cmp -s o2.ppm done.ppm
+check "nothing more to undo or redo" \
+	test "$(grep -c '^Nothing to' out.txt)" -eq 2
+printf 'LOAD g.pgm\nEQUALIZE\nSAVE eq.pgm\nUNDO\nSAVE o1.pgm\nREDO\nSAVE o2.pgm\nEXIT\n' |
+	"$EDITOR" --history 16 > /dev/null
+printf 'LOAD g.pgm\nSAVE first.pgm\nEXIT\n' | "$EDITOR" > /dev/null
+check "undo equalize" cmp -s o1.pgm first.pgm
+check "redo equalize" cmp -s o2.pgm eq.pgm
+printf "LOAD u.ppm\n${edits}UNDO\nEXIT\n" | "$EDITOR" | tail -1 > out.txt
+check "no history without --history" grep -qx 'Nothing to undo' out.txt
+
+# SAVE over the loaded file, then UNDO of the CROP before it: the image kept
+# by the history must not read the new file.
+printf 'LOAD a.ppm\nSELECT 0 0 2 2\nCROP\nSAVE a.ppm\nUNDO\nSAVE b.ppm\nEXIT\n' |
+	"$EDITOR" --history 16 > out.txt 2>&1
+check "save over the file, then undo crop" cmp -s b.ppm orig.ppm
+cp orig.ppm a.ppm
+
+# --batch runs the script on every input and saves under the input's name;
+# an input that can't be loaded fails the run.
+mkdir -p in out
+ascii in/x.pgm P2 9 7 255
+ascii in/y.ppm P3 7 9 255
+printf 'APPLY GAUSSIAN 1\nSAVE ascii\n' > script.txt
+printf 'SAVE ascii\n' > copy.txt
+"$EDITOR" --batch script.txt --jobs 2 --out-dir out in/x.pgm in/y.ppm \
+	> out.txt
+status=$?
+printf 'LOAD in/y.ppm\nAPPLY GAUSSIAN 1\nSAVE y.txt ascii\nEXIT\n' |
+	"$EDITOR" > /dev/null
+check "batch" test $status -eq 0 -a "$(grep -c '^== in/' out.txt)" -eq 2
+check "batch saves every input" cmp -s out/y.ppm y.txt
+check "batch of a grayscale input" grep -qx 'Easy, Charlie Chaplin' out.txt
+"$EDITOR" --batch copy.txt --out-dir out in/x.pgm in/none.pgm > out.txt
+status=$?
+check "batch with an input missing" test $status -eq 1
+check "batch counts the failed input" grep -q '1 images.*, 1 failed$' out.txt
+
+# From a pipe, every command is answered before the next one is sent, and
+# EXIT ends the program even if the pipe stays open.
+mkfifo in.fifo
+"$EDITOR" < in.fifo > out.txt &
+exec 3> in.fifo
+printf 'LOAD a.ppm\n' >&3
+wait_for()
+{
+	# wait_for TEXT: waits up to 5 s for a line of out.txt.
+	t=0
+	while ! grep -qx "$1" out.txt && [ $t -lt 50 ]; do
+		sleep 0.1
+		t=$((t + 1))
+	done
+	grep -qx "$1" out.txt
+}
+check "answer from a pipe" wait_for 'Loaded a.ppm'
+printf 'EXIT\n' >&3
+t=0
+while kill -0 $! 2> /dev/null && [ $t -lt 50 ]; do
+	sleep 0.1
+	t=$((t + 1))
+done
+check "exit with the pipe open" test $t -lt 50
+exec 3>&-
+wait
+
+# SAVE with no file outside of --batch.
+printf 'LOAD a.ppm\nSAVE\nEXIT\n' | "$EDITOR" > out.txt
+check "save with no file" grep -qx 'Invalid command' out.txt
+
+# Every named image keeps its own pixels and selection.
+ascii n1.pgm P2 6 5 255
+ascii n2.ppm P3 8 3 255
+printf 'LOAD n1.pgm AS one\nLOAD n2.ppm AS two\nSELECT 1 1 3 3\nUSE one\nSAVE o1.txt ascii\nUSE two\nCROP\nUSE\nUSE three\nEXIT\n' |
+	"$EDITOR" > out.txt
+check "use a named image" cmp -s o1.txt n1.pgm
+check "crop the named image in use" grep -qx 'Image cropped' out.txt
+check "use an unknown name" grep -qx 'No image named three' out.txt
+
+# A SAVE over a cached file: the next LOAD reads the new file.
+ascii old.pgm P2 6 5 255
+ascii new.pgm P2 6 5 100
+cp old.pgm f.pgm
+printf 'LOAD f.pgm\nLOAD new.pgm\nSAVE f.pgm ascii\nLOAD f.pgm\nSAVE o.txt ascii\nEXIT\n' |
+	"$EDITOR" --cache 16 > /dev/null
+check "cache after a SAVE over its file" cmp -s o.txt new.pgm
+
+# QOI keeps the pixels, and the type and max_value after the end marker.
+for input in a.ppm g.pgm; do
+	printf "LOAD $input\nSAVE q.qoi qoi\nLOAD q.qoi\nSAVE back.txt ascii\nLOAD $input\nSAVE in.txt ascii\nEXIT\n" |
+		"$EDITOR" > /dev/null
+	check "qoi round trip of $input" cmp -s back.txt in.txt
+done
+printf '\0\0\0\0\0\0\0\1P5\0\377' > end.bin
+check "qoi end marker and trailer" \
+	sh -c 'tail -c 12 q.qoi | cmp -s - end.bin'
+head -c $(($(wc -c < q.qoi) - 4)) q.qoi > bare.qoi
+printf 'LOAD bare.qoi\nSAVE bare.txt ascii\nEXIT\n' | "$EDITOR" > /dev/null
+check "qoi without trailer" test "$(sed -n 1p bare.txt)" = P3
+
+# SAVE to a full disk: the failure is printed with the file, with and without
+# write-behind, and no later than EXIT.
+for mode in "" --no-write-behind; do
+	printf 'LOAD a.ppm\nSAVE /dev/full\nEXIT\n' | "$EDITOR" $mode > out.txt
+	check "save to a full disk ${mode:-with write-behind}" \
+		grep -qx 'Failed to save /dev/full' out.txt
+done
+
+exit $failed